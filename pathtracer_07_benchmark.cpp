@@ -0,0 +1,282 @@
+// benchmarks for pathtracer_07, this file includes the whole path tracer, so it's compiled on its own
+#define PATHTRACER_NO_MAIN
+#include "pathtracer_07_multithreading.cpp"
+
+// build BVH over sphere fields of growing size, on one thread and on all of them, and report build time and tree quality
+void benchmark_bvh_build(uint32_t num_threads)
+{
+	const uint32_t sizes[] = { 1000, 10000, 100000, 1000000 };
+	const uint32_t repeats = 3;	// best of few runs, to hide noise from other processes
+
+	printf("BVH build:\n");
+	printf("%10s %8s %10s %10s %10s %6s %9s %9s\n", "spheres", "threads", "time ms", "Mprims/s", "SAH cost", "depth", "avg leaf", "max leaf");
+
+	for (uint32_t size : sizes)
+	{
+		Scene scene;
+		add_sphere_field(scene, size, 1);
+
+		uint32_t thread_counts[] = { 1, num_threads };
+		for (uint32_t t = 0; t < (num_threads > 1 ? 2u : 1u); ++t)
+		{
+			double best_time = 1e30;
+			for (uint32_t r = 0; r < repeats; ++r)
+			{
+				best_time = std::min(best_time, build_bvh(scene, thread_counts[t]));
+			}
+
+			BVHStats stats = measure_bvh(scene.bvh);
+			printf("%10u %8u %10.2f %10.2f %10.2f %6u %9.2f %9u\n", size, thread_counts[t], best_time * 1000.0, size / best_time / 1e6,
+				stats.sah_cost, stats.max_depth, stats.avg_leaf_size, stats.max_leaf_size);
+		}
+	}
+}
+
+// one render configuration, with fixed seeds every run of it traces exactly the same rays
+struct RenderBenchmark
+{
+	const char* name;
+	uint32_t sphere_field;	// small spheres added to the reference scene
+	uint32_t width;
+	uint32_t height;
+	uint32_t samples;		// per pixel, adaptive sampling is off so every pixel gets all of them
+};
+
+struct RenderResult
+{
+	const RenderBenchmark* benchmark;
+	uint32_t threads;
+	double time;			// wall time in seconds, best of few runs
+	uint64_t samples;		// samples traced, there is one primary (camera) ray per sample
+	uint64_t rays;			// primary rays plus all bounces
+};
+
+const uint32_t benchmark_bounces = 10;
+const uint32_t benchmark_tile_size = 32;
+
+// render a frame on num_threads with the same tile scheduling as a single pass of main()
+RenderResult run_render(Scene& scene, const RenderBenchmark& benchmark, uint32_t num_threads)
+{
+	Framebuffer framebuffer = create_framebuffer(benchmark.width, benchmark.height, layout_tiles, benchmark_tile_size, NULL);
+
+	RenderContext ctx = {};
+	ctx.width = benchmark.width;
+	ctx.height = benchmark.height;
+	ctx.bounces = benchmark_bounces;
+	ctx.samples = benchmark.samples;
+	ctx.frame_seed = 1;
+	ctx.scene = &scene;
+	ctx.framebuffer = &framebuffer;
+
+	TileScheduler scheduler = {};
+	scheduler.queues = new TileQueue[num_threads];
+	scheduler.num_queues = num_threads;
+
+	std::vector<TileState> states(num_threads);
+
+	auto start = std::chrono::steady_clock::now();
+
+	schedule_tiles(scheduler, ctx.width, ctx.height, benchmark_tile_size);
+	parallel_run(num_threads, [&](uint32_t thread_id) {
+		Tile tile;
+		while (pop_tile(scheduler, thread_id, tile))
+		{
+			render_tile(tile, ctx, states[thread_id]);
+		}
+	});
+
+	std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+
+	RenderResult result = {};
+	result.benchmark = &benchmark;
+	result.threads = num_threads;
+	result.time = time.count();
+	for (uint32_t y = 0; y < ctx.height; ++y)
+	{
+		for (uint32_t x = 0; x < ctx.width; ++x)
+		{
+			result.samples += framebuffer.pixels[pixel_index(framebuffer, x, y)].count;
+		}
+	}
+	for (const TileState& state : states)
+	{
+		result.rays += state.num_rays;
+	}
+
+	delete[] scheduler.queues;
+	destroy_framebuffer(framebuffer);
+
+	return result;
+}
+
+// render reference scenes on 1, 2, 4... up to num_threads threads, and report throughput and how it scales
+void benchmark_render(uint32_t num_threads, std::vector<RenderResult>& results)
+{
+	static const RenderBenchmark benchmarks[] = {
+		{ "spheres", 0, 640, 480, 16 },
+		{ "field_10k", 10000, 640, 480, 16 },
+		{ "field_1m", 1000000, 640, 480, 8 },
+	};
+	const uint32_t repeats = 2;
+
+	std::vector<uint32_t> thread_counts;
+	for (uint32_t t = 1; t < num_threads; t *= 2)
+	{
+		thread_counts.push_back(t);
+	}
+	thread_counts.push_back(num_threads);
+
+	printf("Render (%u bounces):\n", benchmark_bounces);
+	printf("%10s %10s %5s %8s %9s %10s %12s %8s\n", "scene", "size", "spp", "threads", "time s", "Mrays/s", "Msamples/s", "speedup");
+
+	for (const RenderBenchmark& benchmark : benchmarks)
+	{
+		Scene scene;
+		add_reference_scene(scene);
+		add_sphere_field(scene, benchmark.sphere_field, 1);
+		build_bvh(scene, num_threads);
+
+		double single_thread_time = 0.0;
+		for (uint32_t threads : thread_counts)
+		{
+			RenderResult best = run_render(scene, benchmark, threads);
+			for (uint32_t r = 1; r < repeats; ++r)
+			{
+				RenderResult result = run_render(scene, benchmark, threads);
+				if (result.time < best.time)
+					best = result;
+			}
+
+			if (threads == 1)
+				single_thread_time = best.time;
+
+			char size[32];
+			snprintf(size, sizeof(size), "%ux%u", benchmark.width, benchmark.height);
+			printf("%10s %10s %5u %8u %9.3f %10.2f %12.2f %8.2f\n", benchmark.name, size, benchmark.samples, threads, best.time,
+				best.rays / best.time / 1e6, best.samples / best.time / 1e6, single_thread_time / best.time);
+
+			results.push_back(best);
+		}
+	}
+}
+
+// workers add samples to the pixels of their own tiles, dealt round-robin like schedule_tiles() does, without any path tracing
+// in scanline layout tiles of different workers share cache lines at their edges, so workers keep taking the lines from each other,
+// tiled layouts give every tile its own cache lines and the writes don't slow each other down
+void benchmark_framebuffer_contention(uint32_t num_threads)
+{
+	const uint32_t width = 512;
+	const uint32_t height = 512;
+	const uint32_t tile_sizes[] = { 4, 8, 16 };	// small tiles, so that edges are a big part of them
+	const uint32_t rounds = 64;					// samples per pixel
+	const uint32_t repeats = 3;
+	const FramebufferLayout layouts[] = { layout_scanline, layout_tiles, layout_tiles_morton };
+	const char* layout_names[] = { "scanline", "tiles", "morton" };
+
+	// contention needs threads that run at the same time
+	num_threads = std::max(num_threads, 2u);
+
+	printf("Framebuffer writes (%ux%u, %u threads):\n", width, height, num_threads);
+	printf("%10s %10s %9s %14s\n", "tile size", "layout", "time ms", "Mwrites/s");
+
+	for (uint32_t tile_size : tile_sizes)
+	{
+		uint32_t tiles_x = (width + tile_size - 1) / tile_size;
+		uint32_t tiles_y = (height + tile_size - 1) / tile_size;
+
+		for (uint32_t l = 0; l < 3; ++l)
+		{
+			double best_time = 1e30;
+			for (uint32_t r = 0; r < repeats; ++r)
+			{
+				Framebuffer fb = create_framebuffer(width, height, layouts[l], tile_size, NULL);
+
+				auto start = std::chrono::steady_clock::now();
+
+				parallel_run(num_threads, [&](uint32_t thread_id) {
+					Vec3 color = { 0.5f, 0.5f, 0.5f };
+					for (uint32_t round = 0; round < rounds; ++round)
+					{
+						for (uint32_t tile = thread_id; tile < tiles_x * tiles_y; tile += num_threads)
+						{
+							uint32_t x0 = (tile % tiles_x) * tile_size;
+							uint32_t y0 = (tile / tiles_x) * tile_size;
+							uint32_t x1 = std::min(x0 + tile_size, width);
+
+							// a row of a tile is contiguous in every layout
+							for (uint32_t y = y0; y < std::min(y0 + tile_size, height); ++y)
+							{
+								PixelEstimate* row = &fb.pixels[pixel_index(fb, x0, y)];
+								for (uint32_t x = 0; x < x1 - x0; ++x)
+								{
+									add_sample(row[x], color);
+								}
+							}
+						}
+					}
+				});
+
+				std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+				best_time = std::min(best_time, time.count());
+
+				destroy_framebuffer(fb);
+			}
+
+			printf("%10u %10s %9.2f %14.2f\n", tile_size, layout_names[l], best_time * 1000.0, (double)width * height * rounds / best_time / 1e6);
+		}
+	}
+}
+
+// write render results as JSON, one record per scene and thread count, for tracking regressions and plotting scaling
+bool save_results_json(const char* filename, const std::vector<RenderResult>& results, uint32_t num_threads)
+{
+	FILE* file = fopen(filename, "w");
+	if (!file)
+		return false;
+
+	fprintf(file, "{\n");
+	fprintf(file, "\t\"hardware_threads\": %u,\n", num_threads);
+	fprintf(file, "\t\"bounces\": %u,\n", benchmark_bounces);
+	fprintf(file, "\t\"tile_size\": %u,\n", benchmark_tile_size);
+	fprintf(file, "\t\"render\": [\n");
+
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const RenderResult& r = results[i];
+		fprintf(file, "\t\t{ \"scene\": \"%s\", \"field_spheres\": %u, \"width\": %u, \"height\": %u, \"spp\": %u, \"threads\": %u, "
+			"\"wall_time_s\": %.6f, \"samples\": %llu, \"rays\": %llu, "
+			"\"rays_per_s\": %.1f, \"samples_per_s\": %.1f }%s\n",
+			r.benchmark->name, r.benchmark->sphere_field, r.benchmark->width, r.benchmark->height, r.benchmark->samples, r.threads,
+			r.time, (unsigned long long)r.samples, (unsigned long long)r.rays,
+			r.rays / r.time, r.samples / r.time, i + 1 < results.size() ? "," : "");
+	}
+
+	fprintf(file, "\t]\n");
+	fprintf(file, "}\n");
+
+	return fclose(file) == 0;
+}
+
+int main(int argc, const char* argv[])
+{
+	const uint32_t num_threads = std::thread::hardware_concurrency();
+	const char* json_filename = argc > 1 ? argv[1] : "benchmark.json";
+
+	benchmark_bvh_build(num_threads);
+
+	printf("\n");
+
+	benchmark_framebuffer_contention(num_threads);
+
+	printf("\n");
+
+	std::vector<RenderResult> results;
+	benchmark_render(num_threads, results);
+
+	if (save_results_json(json_filename, results, num_threads))
+		printf("\nSaved results to %s\n", json_filename);
+	else
+		printf("\nCannot save to %s\n", json_filename);
+
+	return 0;
+}
@@ -3,12 +3,75 @@
 #include <stdint.h>
 #include <time.h>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+#if defined(_MSC_VER)
+#include <malloc.h>		// _aligned_malloc
+#endif
+
+#if defined(__linux__)
+#include <pthread.h>	// pinning workers to NUMA nodes
+#include <sched.h>
+#endif
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #define _CRT_SECURE_NO_WARNINGS
 #define __STDC_LIB_EXT1__
+#define STBIW_PARALLEL_FOR(count, func, context) png_parallel_for(count, func, context)
+void png_parallel_for(int count, void (*func)(void* context, int index), void* context);
 #include "png.h"
 
+// SSE is always there on x64, other platforms use plain scalar code
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PATHTRACER_SSE 1
+#include <emmintrin.h>
+#else
+#define PATHTRACER_SSE 0
+#endif
+
+// AVX sphere kernel is compiled in with a target attribute and used when cpuid says the CPU has it, otherwise spheres are tested 4 at a time with SSE
+#if PATHTRACER_SSE && defined(_MSC_VER)
+#define PATHTRACER_AVX 1
+#define PATHTRACER_TARGET_AVX
+#include <intrin.h>
+#include <immintrin.h>
+#elif PATHTRACER_SSE && (defined(__GNUC__) || defined(__clang__))
+#define PATHTRACER_AVX 1
+#define PATHTRACER_TARGET_AVX __attribute__((target("avx")))
+#include <immintrin.h>
+#else
+#define PATHTRACER_AVX 0
+#endif
+
+// cycle counter for timing single pixels in heatmap mode, other platforms use steady clock
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define PATHTRACER_RDTSC 1
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#define PATHTRACER_RDTSC 1
+#include <x86intrin.h>
+#else
+#define PATHTRACER_RDTSC 0
+#endif
+
+// render statistics (rays per bounce, intersection tests, hits and misses) printed after the render
+// off by default, build with PATHTRACER_STATS=1 to collect them, when off the counters aren't compiled in at all
+#ifndef PATHTRACER_STATS
+#define PATHTRACER_STATS 0
+#endif
+
+#if PATHTRACER_STATS
+#define PATHTRACER_STAT(statement) statement
+#else
+#define PATHTRACER_STAT(statement)
+#endif
+
 // 3D vector (or color, or whatever has 3 floats)
 struct Vec3
 {
@@ -68,7 +131,7 @@ float saturate(float a)
 
 Vec3 saturate(Vec3 a)
 {
-	return { saturate(a.x), saturate(a.x), saturate(a.x) };
+	return { saturate(a.x), saturate(a.y), saturate(a.z) };
 }
 
 // normalise vector a (scale the vector so its length is equal to 1)
@@ -83,23 +146,94 @@ Vec3 reflect(Vec3 a, Vec3 n)
 	return sub(a, mul(n, 2.0f * dot(a, n)));
 }
 
-float randf()
+// smaller of each element of vectors a and b
+Vec3 min(Vec3 a, Vec3 b)
+{
+	return { a.x < b.x ? a.x : b.x, a.y < b.y ? a.y : b.y, a.z < b.z ? a.z : b.z };
+}
+
+// bigger of each element of vectors a and b
+Vec3 max(Vec3 a, Vec3 b)
+{
+	return { a.x > b.x ? a.x : b.x, a.y > b.y ? a.y : b.y, a.z > b.z ? a.z : b.z };
+}
+
+// element of vector a along axis (0 - x, 1 - y, 2 - z)
+float axis(Vec3 a, uint32_t i)
+{
+	return i == 0 ? a.x : (i == 1 ? a.y : a.z);
+}
+
+// random number generator (PCG32), each thread owns its own, so drawing numbers never touches shared state
+struct Sampler
+{
+	uint64_t state;	// advances with every number drawn
+	uint64_t inc;	// selects the stream, must be odd
+};
+
+// next random 32-bit integer
+uint32_t rand_u32(Sampler& sampler)
+{
+	uint64_t old = sampler.state;
+	sampler.state = old * 6364136223846793005ull + sampler.inc;
+
+	uint32_t xorshifted = (uint32_t)(((old >> 18u) ^ old) >> 27u);
+	uint32_t rot = (uint32_t)(old >> 59u);
+	return (xorshifted >> rot) | (xorshifted << ((0u - rot) & 31u));
+}
+
+// samplers with the same seed but different streams produce independent sequences
+Sampler make_sampler(uint64_t seed, uint64_t stream)
+{
+	Sampler sampler;
+	sampler.state = 0;
+	sampler.inc = (stream << 1u) | 1u;
+	rand_u32(sampler);
+	sampler.state += seed;
+	rand_u32(sampler);
+	return sampler;
+}
+
+// mix bits of a 64-bit value (splitmix64 finalizer), so nearby inputs give unrelated outputs
+uint64_t hash64(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ull;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebull;
+	x ^= x >> 31;
+	return x;
+}
+
+// sampler for a single pixel sample, its sequence depends only on the pixel, the sample index and the frame seed,
+// so the result doesn't depend on which thread renders the pixel, or when
+Sampler make_pixel_sampler(uint64_t frame_seed, uint32_t x, uint32_t y, uint32_t sample)
+{
+	uint64_t pixel = ((uint64_t)y << 32) | x;
+	return make_sampler(hash64(frame_seed ^ hash64(pixel)), sample);
+}
+
+// random number in range [0, 1)
+float randf(Sampler& sampler)
 {
-	return rand() / (RAND_MAX + 1.0f);
+	return (rand_u32(sampler) >> 8) * (1.0f / 16777216.0f);	// top 24 bits, as many as float can hold
 }
 
-Vec3 randf3()
+Vec3 randf3(Sampler& sampler)
 {
-	return { 2.0f * randf() - 1.0f, 2.0f * randf() - 1.0f, 2.0f * randf() - 1.0f };
+	float x = 2.0f * randf(sampler) - 1.0f;
+	float y = 2.0f * randf(sampler) - 1.0f;
+	float z = 2.0f * randf(sampler) - 1.0f;
+	return { x, y, z };
 }
 
-Vec3 rand_in_sphere()
+Vec3 rand_in_sphere(Sampler& sampler)
 {
-	Vec3 value = randf3();
+	Vec3 value = randf3(sampler);
 
 	while (mag(value) > 1.0f)
 	{
-		value = randf3();
+		value = randf3(sampler);
 	}
 
 	return value;
@@ -134,9 +268,9 @@ void adjust(Ray& r)
 	r.pos = add(r.pos, mul(r.dir, 0.0001f));
 }
 
-void perturb(Ray& r, float degree)
+void perturb(Ray& r, float degree, Sampler& sampler)
 {
-	Vec3 v = mul(rand_in_sphere(), degree);
+	Vec3 v = mul(rand_in_sphere(sampler), degree);
 	r.dir = norm(add(r.dir, v));
 }
 
@@ -150,38 +284,90 @@ struct Hit
 	float roughness;	// 0.0 - smooth (metallic), 0.9 - rough (diaelectric), don't use 1.0
 };
 
-// test intersection (collision) between ray and sphere
-bool intersect(Ray ray, Sphere sphere, Hit& hit)
+// fill hit information for ray hitting sphere at distance
+void fill_hit(Ray ray, const Sphere& sphere, float distance, Hit& hit)
 {
-	Vec3 c = sub(sphere.pos, ray.pos);
-	float d = mag(cross(ray.dir, c));
-	float t1 = dot(ray.dir, c);
+	hit.distance = distance;
+	hit.pos = add(ray.pos, mul(ray.dir, hit.distance));
+	hit.normal = norm(sub(hit.pos, sphere.pos));
+	hit.color = sphere.color;
+	hit.roughness = sphere.roughness;
 
-	// if distance between sphere center and ray is less than or equal radius, then we have a hit!
-	if (t1 > 0.0f && d <= sphere.radius)
+	if (dot(ray.dir, hit.normal) > 0.0f)
 	{
-		float t2 = sqrt(sphere.radius * sphere.radius - d * d);
+		hit.normal = mul(hit.normal, -1.0f);
+	}
+}
 
-		hit.distance = t1 - t2;
-		hit.pos = add(ray.pos, mul(ray.dir, hit.distance));
-		hit.normal = norm(sub(hit.pos, sphere.pos));
-		hit.color = sphere.color;
-		hit.roughness = sphere.roughness;
+const uint32_t stats_max_depth = 16;	// rays deeper than that are counted with the last depth
 
-		if (dot(ray.dir, hit.normal) > 0.0f)
-		{
-			hit.normal = mul(hit.normal, -1.0f);
-		}
+// counters of a single worker, aligned to a cache line so that workers never write to the same line
+struct alignas(64) RenderStats
+{
+	uint64_t rays[stats_max_depth];	// rays traced at each bounce depth, camera rays are depth 0
+	uint64_t hits;
+	uint64_t misses;				// rays that hit nothing and see the background, each ends its path
+	uint64_t roulette;				// paths terminated by Russian roulette
+	uint64_t bounce_limit;			// paths that ran out of bounces
+	uint64_t node_tests;			// ray against BVH4 node, 4 boxes at once
+	uint64_t sphere_tests;
+	uint64_t plane_tests;
+};
 
-		return true;
+#if PATHTRACER_STATS
+RenderStats discarded_stats;							// counts from threads that aren't render workers
+thread_local RenderStats* thread_stats = &discarded_stats;	// where the current thread counts, workers point it to their TileState
+#endif
+
+void merge_stats(RenderStats& total, const RenderStats& stats)
+{
+	for (uint32_t d = 0; d < stats_max_depth; ++d)
+	{
+		total.rays[d] += stats.rays[d];
 	}
+	total.hits += stats.hits;
+	total.misses += stats.misses;
+	total.roulette += stats.roulette;
+	total.bounce_limit += stats.bounce_limit;
+	total.node_tests += stats.node_tests;
+	total.sphere_tests += stats.sphere_tests;
+	total.plane_tests += stats.plane_tests;
+}
 
-	return false;
+void print_render_stats(const RenderStats& stats)
+{
+	uint64_t rays = 0;
+	for (uint32_t d = 0; d < stats_max_depth; ++d)
+	{
+		rays += stats.rays[d];
+	}
+
+	// every path ends in one of three ways
+	uint64_t paths = stats.misses + stats.roulette + stats.bounce_limit;
+	double per_ray = 1.0 / (double)std::max(rays, (uint64_t)1);
+	double per_path = 1.0 / (double)std::max(paths, (uint64_t)1);
+
+	printf("Render stats:\n");
+	printf("- %llu paths, %llu rays, average path length %.2f rays\n", (unsigned long long)paths, (unsigned long long)rays, rays * per_path);
+	printf("- hits %.1f%%, misses (background) %.1f%%\n", 100.0 * stats.hits * per_ray, 100.0 * stats.misses * per_ray);
+	printf("- paths ended by background %.1f%%, Russian roulette %.1f%%, bounce limit %.1f%%\n",
+		100.0 * stats.misses * per_path, 100.0 * stats.roulette * per_path, 100.0 * stats.bounce_limit * per_path);
+	printf("- tests per ray: %.2f BVH nodes (%.2f boxes), %.2f spheres, %.2f planes\n",
+		stats.node_tests * per_ray, 4.0 * stats.node_tests * per_ray, stats.sphere_tests * per_ray, stats.plane_tests * per_ray);
+	printf("- rays per bounce depth:");
+	for (uint32_t d = 0; d < stats_max_depth; ++d)
+	{
+		if (stats.rays[d] > 0)
+			printf(" %u%s: %.1f%%", d, d + 1 == stats_max_depth ? "+" : "", 100.0 * stats.rays[d] * per_ray);
+	}
+	printf("\n");
 }
 
 // test intersection (collision) between ray and plane
 bool intersect(Ray ray, Plane plane, Hit& hit)
 {
+	PATHTRACER_STAT(thread_stats->plane_tests++);
+
 	float denom = dot(ray.dir, plane.normal);
 	if (denom > 0.000001f)
 	{
@@ -197,200 +383,2528 @@ bool intersect(Ray ray, Plane plane, Hit& hit)
 	return false;
 }
 
-struct Scene
+// threads that live for the whole process and run one job at a time, so passes and frames don't pay for creating threads
+// between jobs workers spin for a moment, in case the next job comes right away, then sleep on a condition variable
+struct ThreadPool
 {
-	Sphere s1;
-	Sphere s2;
-	Sphere s3;
-	Plane p1;
+	std::mutex mutex;
+	std::condition_variable wake;		// workers wait here for the next job
+	std::condition_variable done;		// submitters wait here for the job to finish
+	std::vector<std::thread> threads;
+
+	void (*func)(void* context, uint32_t thread_id) = NULL;	// current job, runs on workers [0, num_threads)
+	void* context = NULL;
+	uint32_t num_threads = 0;
+	uint32_t running = 0;				// workers that didn't finish current job yet
+
+	std::atomic<uint64_t> submitted{ 0 };	// job counter, every job gets the next number as its fence
+	uint64_t finished = 0;				// fence of the last finished job
+	bool quit = false;
+
+	~ThreadPool();
 };
 
-bool intersect(Ray ray, Scene& scene, Hit& hit)
+const uint32_t pool_spin_count = 64;	// checks for next job before worker goes to sleep, yielding in between so that spinning workers don't hold back other threads
+thread_local bool is_pool_worker = false;
+
+void pool_worker(ThreadPool& pool, uint32_t index)
 {
-	Hit temp_hit = {};
-	float distance = 10000.0f;
-	bool is_hit = 0.0f;
+	is_pool_worker = true;
+	uint64_t seen = 0;
 
-	if (intersect(ray, scene.s1, temp_hit))
+	for (;;)
 	{
-		if (temp_hit.distance < distance)
+		for (uint32_t spin = 0; spin < pool_spin_count && pool.submitted.load(std::memory_order_relaxed) == seen; ++spin)
 		{
-			hit = temp_hit;
-			distance = temp_hit.distance;
-			is_hit = true;
+			std::this_thread::yield();
 		}
-	}
 
-	if (intersect(ray, scene.s2, temp_hit))
-	{
-		if (temp_hit.distance < distance)
+		void (*func)(void* context, uint32_t thread_id);
+		void* context;
+		uint32_t num_threads;
 		{
-			hit = temp_hit;
-			distance = temp_hit.distance;
-			is_hit = true;
+			std::unique_lock<std::mutex> lock(pool.mutex);
+			pool.wake.wait(lock, [&] { return pool.submitted != seen || pool.quit; });
+			if (pool.quit)
+				return;
+
+			seen = pool.submitted;
+			func = pool.func;
+			context = pool.context;
+			num_threads = pool.num_threads;
+		}
+
+		// jobs may use fewer threads than the pool has, the rest only note that they saw it
+		if (index >= num_threads)
+			continue;
+
+		func(context, index);
+
+		std::lock_guard<std::mutex> lock(pool.mutex);
+		if (--pool.running == 0)
+		{
+			pool.finished = seen;
+			pool.done.notify_all();
 		}
 	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	wake.notify_all();
+
+	for (std::thread& thread : threads)
+	{
+		thread.join();
+	}
+}
+
+// the pool of the process, created on first use
+ThreadPool& thread_pool()
+{
+	static ThreadPool pool;
+	return pool;
+}
+
+// start func(context, thread_id) on num_threads pool workers, returns fence to wait for with wait_for_job()
+// waits for the previous job first, pool runs one job at a time; more workers are started if the pool is too small
+uint64_t submit_job(ThreadPool& pool, uint32_t num_threads, void (*func)(void* context, uint32_t thread_id), void* context)
+{
+	std::unique_lock<std::mutex> lock(pool.mutex);
+	pool.done.wait(lock, [&] { return pool.finished == pool.submitted; });
+
+	while (pool.threads.size() < num_threads)
+	{
+		pool.threads.push_back(std::thread(pool_worker, std::ref(pool), (uint32_t)pool.threads.size()));
+	}
+
+	pool.func = func;
+	pool.context = context;
+	pool.num_threads = num_threads;
+	pool.running = num_threads;
+	uint64_t fence = ++pool.submitted;
+
+	// jobs with no threads are done right away
+	if (num_threads == 0)
+		pool.finished = fence;
+
+	lock.unlock();
+	pool.wake.notify_all();
+
+	return fence;
+}
+
+void wait_for_job(ThreadPool& pool, uint64_t fence)
+{
+	std::unique_lock<std::mutex> lock(pool.mutex);
+	pool.done.wait(lock, [&] { return pool.finished >= fence; });
+}
 
-	if (intersect(ray, scene.s3, temp_hit))
+// run job(thread_id) on num_threads threads at the same time, and wait until all of them finish
+template <typename Job>
+void parallel_run(uint32_t num_threads, Job job)
+{
+	// pool workers can't wait for the pool, jobs started from them get threads of their own
+	if (is_pool_worker)
 	{
-		if (temp_hit.distance < distance)
+		std::vector<std::thread> threads;
+		for (uint32_t t = 0; t < num_threads; ++t)
 		{
-			hit = temp_hit;
-			distance = temp_hit.distance;
-			is_hit = true;
+			threads.push_back(std::thread(job, t));
 		}
+
+		for (std::thread& thread : threads)
+		{
+			thread.join();
+		}
+		return;
 	}
 
-	if (intersect(ray, scene.p1, temp_hit))
+	ThreadPool& pool = thread_pool();
+	uint64_t fence = submit_job(pool, num_threads, [](void* context, uint32_t thread_id) { (*(Job*)context)(thread_id); }, &job);
+	wait_for_job(pool, fence);
+}
+
+// run func(context, i) for every i in [0, count) on all hardware threads, png.h uses it to filter and compress pieces of the image
+void png_parallel_for(int count, void (*func)(void* context, int index), void* context)
+{
+	const uint32_t num_threads = std::min((uint32_t)count, std::max(std::thread::hardware_concurrency(), 1u));
+
+	std::atomic<int> next(0);
+	parallel_run(num_threads, [&](uint32_t) {
+		for (int i = next++; i < count; i = next++)
+		{
+			func(context, i);
+		}
+	});
+}
+
+// NUMA nodes (sockets with their own memory) and the node each worker runs on
+// read from /sys on Linux, everywhere else, and on machines with one node, it's a single node and nothing gets pinned
+struct NumaTopology
+{
+	std::vector<std::vector<uint32_t>> node_cpus;	// CPUs of every node that has any
+	std::vector<uint32_t> worker_node;				// node of every worker, in ascending order
+	std::vector<uint32_t> node_rows;				// tile rows of node n are [node_rows[n], node_rows[n + 1]), see assign_tile_rows()
+};
+
+// parse Linux CPU list like "0-3,8-11" from file
+bool read_cpu_list(const char* path, std::vector<uint32_t>& cpus)
+{
+	FILE* file = fopen(path, "r");
+	if (!file)
+		return false;
+
+	char line[8192];
+	bool ok = fgets(line, sizeof(line), file) != NULL;
+	fclose(file);
+
+	for (char* p = line; ok && *p != '\0' && *p != '\n';)
 	{
-		if (temp_hit.distance < distance)
+		char* end = NULL;
+		uint32_t first = (uint32_t)strtoul(p, &end, 10);
+		if (end == p)
+			break;
+
+		uint32_t last = first;
+		if (*end == '-')
 		{
-			hit = temp_hit;
-			distance = temp_hit.distance;
-			is_hit = true;
+			p = end + 1;
+			last = (uint32_t)strtoul(p, &end, 10);
+		}
+
+		for (uint32_t cpu = first; cpu <= last; ++cpu)
+		{
+			cpus.push_back(cpu);
 		}
+
+		p = *end == ',' ? end + 1 : end;
 	}
 
-	return is_hit;
+	return ok;
 }
 
-Vec3 path_tracing(Ray ray, Scene& scene, uint32_t bounces)
+// enabled false gives a single node, same as on machines without NUMA
+NumaTopology detect_numa(uint32_t num_workers, bool enabled)
 {
-	// if ray doesn't hit anything, return background color
-	Hit hit = {};
-	if (bounces == 0 || !intersect(ray, scene, hit))
+	NumaTopology numa;
+
+#if defined(__linux__)
+	std::vector<uint32_t> nodes;
+	if (enabled)
+		read_cpu_list("/sys/devices/system/node/online", nodes);
+
+	// only CPUs this process may run on, e.g. under taskset
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	bool has_affinity = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+	for (uint32_t node : nodes)
 	{
-		// return white-blue gradient
-		Vec3 white = { 1.0f, 1.0f, 1.0f };
-		Vec3 blue = { 0.5f, 0.7f, 1.0f };
-		float t = saturate(0.5f * (ray.dir.y + 1.0f));
-		return add(mul(white, t), mul(blue, 1.0f - t));
+		char path[128];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+
+		std::vector<uint32_t> cpus;
+		read_cpu_list(path, cpus);
+		cpus.erase(std::remove_if(cpus.begin(), cpus.end(), [&](uint32_t cpu) {
+			return has_affinity && (cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed));
+		}), cpus.end());
+
+		// nodes with memory only
+		if (!cpus.empty())
+			numa.node_cpus.push_back(cpus);
 	}
+#endif
 
-	bounces--;
-
-	Vec3 reflected = reflect(ray.dir, hit.normal);
+	if (numa.node_cpus.empty())
+		numa.node_cpus.resize(1);
 
-	Ray ray_bounce;
-	ray_bounce.pos = hit.pos;
-	ray_bounce.dir = reflected;
-	adjust(ray_bounce);
-	perturb(ray_bounce, hit.roughness);
+	// workers spread over nodes in proportion to their CPUs
+	std::vector<uint32_t> cpu_node;
+	for (uint32_t node = 0; node < numa.node_cpus.size(); ++node)
+	{
+		cpu_node.resize(cpu_node.size() + std::max((uint32_t)numa.node_cpus[node].size(), 1u), node);
+	}
 
-	Vec3 color = hit.color;
+	numa.worker_node.resize(num_workers);
+	for (uint32_t i = 0; i < num_workers; ++i)
+	{
+		numa.worker_node[i] = cpu_node[(uint64_t)i * cpu_node.size() / num_workers];
+	}
 
-	return mul(color, path_tracing(ray_bounce, scene, bounces));
+	return numa;
 }
 
-Vec3 render(uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint32_t bounces, uint32_t samples, Scene& scene)
+uint32_t num_nodes(const NumaTopology& numa)
 {
-	// camera
-	Vec3 camera_pos = { 0.0f, 0.0f, -3.0f };
-	float camera_near = 0.5f;	// distance from camera position to the near plane of the camera
+	return (uint32_t)numa.node_cpus.size();
+}
 
-	// pixel position is on the camera near plane
-	float aspect_ratio = width / (float)height;
-	Vec3 pixel_pos = {
-		aspect_ratio * (float)x / (float)width - (aspect_ratio - 1.0f) * 0.5f - 0.5f,
-		(float)y / (float)height - 0.5f,
-		camera_pos.z + camera_near
-	};
+// workers of a node are next to each other, [first, first + count)
+void node_workers(const NumaTopology& numa, uint32_t node, uint32_t& first, uint32_t& count)
+{
+	first = (uint32_t)(std::lower_bound(numa.worker_node.begin(), numa.worker_node.end(), node) - numa.worker_node.begin());
+	count = (uint32_t)(std::upper_bound(numa.worker_node.begin(), numa.worker_node.end(), node) - numa.worker_node.begin()) - first;
+}
 
-	float sub_x = aspect_ratio / width;
-	float sub_y = 1.0f / height;
+// image is cut into bands of tile rows, one per node and as tall as its share of workers, so each node's pixels are together in memory
+// framebuffer first touch and tile scheduling both go by these bands; nodes with few workers may get no rows at all
+void assign_tile_rows(NumaTopology& numa, uint32_t num_rows)
+{
+	uint32_t nodes = num_nodes(numa);
+	numa.node_rows.assign(nodes + 1, num_rows);
+	if (numa.worker_node.empty())
+		return;
 
-	Vec3 color = {};
+	// row goes to the node of the worker in the middle of the row's share, walking backwards leaves the first row of each node
+	for (uint32_t row = num_rows; row-- > 0;)
+	{
+		uint32_t node = numa.worker_node[(uint64_t)(2 * row + 1) * numa.worker_node.size() / (2 * num_rows)];
+		numa.node_rows[node] = row;
+	}
 
-	for (uint32_t i = 0; i < samples; ++i)
+	// nodes without rows get an empty band where the next one starts
+	for (uint32_t node = nodes; node-- > 0;)
 	{
-		Vec3 rand_pixel_pos = pixel_pos;
-		rand_pixel_pos.x += randf() * sub_x - 0.5f * sub_x;
-		rand_pixel_pos.y += randf() * sub_y - 0.5f * sub_y;
+		numa.node_rows[node] = std::min(numa.node_rows[node], numa.node_rows[node + 1]);
+	}
+}
 
-		// ray starting at pixel position
-		Ray ray;
-		ray.pos = rand_pixel_pos;
-		ray.dir = norm(sub(rand_pixel_pos, camera_pos));
+// node whose band has the tile row
+uint32_t tile_row_node(const NumaTopology& numa, uint32_t row)
+{
+	return (uint32_t)(std::upper_bound(numa.node_rows.begin(), numa.node_rows.end(), row) - numa.node_rows.begin()) - 1;
+}
 
-		color = add(color, path_tracing(ray, scene, bounces));
-	}
+// tile rows are split between nodes only with more nodes, and after assign_tile_rows() for the same number of rows
+bool has_node_rows(const NumaTopology* numa, uint32_t num_rows)
+{
+	return numa && num_nodes(*numa) > 1 && numa->node_rows.size() == num_nodes(*numa) + 1 && numa->node_rows.back() == num_rows;
+}
 
-	return mul(color, 1.0f / (float)samples);
+// pin every worker to the CPUs of its node, pool workers keep their thread_id, so it holds for all later jobs
+void pin_workers(const NumaTopology& numa)
+{
+	if (num_nodes(numa) < 2)
+		return;
+
+#if defined(__linux__)
+	parallel_run((uint32_t)numa.worker_node.size(), [&](uint32_t thread_id) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (uint32_t cpu : numa.node_cpus[numa.worker_node[thread_id]])
+		{
+			if (cpu < CPU_SETSIZE)
+				CPU_SET(cpu, &set);
+		}
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	});
+#endif
 }
 
-int main(int argc, const char* argv[])
+// timeline of what every thread did and when, saved as Chrome trace events (open in chrome://tracing or ui.perfetto.dev)
+struct TraceEvent
 {
-	srand((uint32_t)time(NULL));
+	const char* name;	// string literal, only the pointer is kept
+	uint64_t begin;		// nanoseconds since the trace started
+	uint64_t end;
+	int32_t x, y;		// tile position, -1 for events that aren't tiles
+};
 
-	// settings
-	const uint32_t width = 1024;
-	const uint32_t height = 768;
-	const uint32_t bounces = 10;
-	const uint32_t samples = 1000;
+const uint32_t trace_buffer_size = 1 << 16;	// events kept per thread, once full the oldest get overwritten
 
-	// useful variables
-	const uint32_t stride = 3;
-	const uint32_t image_size = width * height * stride;
-	const uint32_t num_threads = std::thread::hardware_concurrency();
-	const uint32_t range = height / num_threads;
+// ring buffer of a single thread's events, only that thread writes to it
+struct alignas(64) TraceBuffer
+{
+	char name[32];					// thread name shown in the viewer
+	std::vector<TraceEvent> events;
+	uint64_t count;					// events recorded so far, all but the last trace_buffer_size are lost
+};
+
+struct Trace
+{
+	std::chrono::steady_clock::time_point start;
+	std::vector<TraceBuffer> threads;	// main thread is 0, worker i is 1 + i, png encoder is the last one
+};
 
-	// allocate and 'zero' (clear) image memory
-	void* image = malloc(image_size);
-	memset(image, 0, image_size);
+// trace with buffers for the main thread, num_workers workers and png encoder, time starts now
+void create_trace(Trace& trace, uint32_t num_workers)
+{
+	trace.start = std::chrono::steady_clock::now();
+	trace.threads = std::vector<TraceBuffer>(num_workers + 2);
+
+	for (uint32_t i = 0; i < num_workers + 2; ++i)
+	{
+		TraceBuffer& buffer = trace.threads[i];
+		if (i == 0)
+			snprintf(buffer.name, sizeof(buffer.name), "main");
+		else if (i <= num_workers)
+			snprintf(buffer.name, sizeof(buffer.name), "worker %u", i - 1);
+		else
+			snprintf(buffer.name, sizeof(buffer.name), "png encoder");
+
+		buffer.events.resize(trace_buffer_size);
+		buffer.count = 0;
+	}
+}
 
-	uint8_t* pixel = (uint8_t*)image;
+// current time for the beginning of an event, trace is NULL when tracing is off
+uint64_t trace_time(const Trace* trace)
+{
+	if (!trace)
+		return 0;
 
-	// scene
-	Scene scene = {};
-	scene.s1 = { {-2.0f, 0.0f, 0.0f}, 1.0f, {0.8f, 0.3f, 0.2f}, 0.04f };
-	scene.s2 = { {0.0f, 0.0f, 0.0f}, 1.0f, {0.3f, 0.8f, 0.2f}, 0.3f };
-	scene.s3 = { {2.0f, 0.0f, 0.0f}, 1.0f, {0.2f, 0.3f, 0.8f}, 0.9f };
-	scene.p1 = { {0.0f, 1.0f, 0.0f}, -1.0f, {0.8f, 0.8f, 0.8f}, 0.9f };
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - trace->start).count();
+}
 
-	std::thread* jobs = new std::thread[num_threads];
+// record event that started at begin and ends now on given thread's buffer
+void trace_event(Trace* trace, uint32_t thread, const char* name, uint64_t begin, int32_t x = -1, int32_t y = -1)
+{
+	if (!trace)
+		return;
+
+	TraceBuffer& buffer = trace->threads[thread];
+	TraceEvent& event = buffer.events[buffer.count % trace_buffer_size];
+	event.name = name;
+	event.begin = begin;
+	event.end = trace_time(trace);
+	event.x = x;
+	event.y = y;
+	++buffer.count;
+}
+
+// save all recorded events as Chrome trace JSON, call when no thread records anymore
+bool save_trace(const Trace& trace, const char* filename)
+{
+	FILE* file = fopen(filename, "w");
+	if (!file)
+		return false;
 
-	for (uint32_t t = 0; t < num_threads; ++t)
+	fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+
+	for (uint32_t t = 0; t < trace.threads.size(); ++t)
 	{
-		// render pixels
-		jobs[t] = std::thread(
-			[&](uint32_t thread_id) {
-				for (uint32_t y = range * thread_id; thread_id < num_threads - 1 ? y < range * (thread_id + 1) : y < height; ++y)
-				{
-					for (uint32_t x = 0; x < width; ++x)
-					{
-						// render single pixel
-						Vec3 color = render(x, y, width, height, bounces, samples, scene);
-
-						uint8_t* pixel = (uint8_t*)image + stride * (x + y * width);
-
-						// translate from Vec3 color to bytes color
-						pixel[0] = color.x * 255.0f;
-						pixel[1] = color.y * 255.0f;
-						pixel[2] = color.z * 255.0f;
-					}
-				}
-			},
-			t);
+		const TraceBuffer& buffer = trace.threads[t];
+		fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": \"%s\"}}", t ? ",\n" : "", t, buffer.name);
+
+		if (buffer.count > trace_buffer_size)
+			printf("Trace: %llu oldest events of %s were lost\n", (unsigned long long)(buffer.count - trace_buffer_size), buffer.name);
+
+		// oldest to newest
+		uint64_t first = buffer.count > trace_buffer_size ? buffer.count - trace_buffer_size : 0;
+		for (uint64_t i = first; i < buffer.count; ++i)
+		{
+			const TraceEvent& event = buffer.events[i % trace_buffer_size];
+			fprintf(file, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f", event.name, t, event.begin / 1000.0, (event.end - event.begin) / 1000.0);
+			if (event.x >= 0)
+				fprintf(file, ", \"args\": {\"x\": %d, \"y\": %d}", event.x, event.y);
+			fprintf(file, "}");
+		}
 	}
 
-	printf("Scheduled %i jobs:\n", num_threads);
-	for (uint32_t t = 0; t < num_threads; ++t)
+	fprintf(file, "\n]}\n");
+
+	return fclose(file) == 0;
+}
+
+// axis aligned bounding box
+struct AABB
+{
+	Vec3 min;	// corner with the smallest coordinates
+	Vec3 max;	// corner with the biggest coordinates
+};
+
+AABB empty_aabb()
+{
+	return { { 1e30f, 1e30f, 1e30f }, { -1e30f, -1e30f, -1e30f } };
+}
+
+// smallest box containing both a and b
+AABB merge(AABB a, AABB b)
+{
+	return { min(a.min, b.min), max(a.max, b.max) };
+}
+
+AABB bounds(Sphere sphere)
+{
+	Vec3 r = { sphere.radius, sphere.radius, sphere.radius };
+	return { sub(sphere.pos, r), add(sphere.pos, r) };
+}
+
+// test intersection between ray and box, inv_dir is 1 / ray.dir, hit only counts if it's closer than max_distance
+bool intersect(Ray ray, Vec3 inv_dir, AABB box, float max_distance)
+{
+	float tx1 = (box.min.x - ray.pos.x) * inv_dir.x;
+	float tx2 = (box.max.x - ray.pos.x) * inv_dir.x;
+	float ty1 = (box.min.y - ray.pos.y) * inv_dir.y;
+	float ty2 = (box.max.y - ray.pos.y) * inv_dir.y;
+	float tz1 = (box.min.z - ray.pos.z) * inv_dir.z;
+	float tz2 = (box.max.z - ray.pos.z) * inv_dir.z;
+
+	// ray is inside the box between the last entry and the first exit along all three axes
+	float t_enter = fmaxf(fmaxf(fminf(tx1, tx2), fminf(ty1, ty2)), fminf(tz1, tz2));
+	float t_exit = fminf(fminf(fmaxf(tx1, tx2), fmaxf(ty1, ty2)), fmaxf(tz1, tz2));
+
+	return t_exit >= fmaxf(t_enter, 0.0f) && t_enter < max_distance;
+}
+
+// node of bounding volume hierarchy (BVH), a binary tree of boxes, each box contains all primitives below it
+struct BVHNode
+{
+	AABB bounds;
+	uint32_t first;	// leaf: index of the first primitive in BVH::indices, inner node: index of the left child, right child is next to it
+	uint32_t count;	// number of primitives in leaf, 0 for inner nodes
+};
+
+// node of 4-wide BVH, made by collapsing two levels of the binary tree into one
+// bounds of the four children are stored as structure of arrays, so a ray is tested against all of them with one SIMD instruction sequence
+struct alignas(16) BVH4Node
+{
+	float min_x[4], min_y[4], min_z[4];
+	float max_x[4], max_y[4], max_z[4];
+	uint32_t child[4];	// inner child: index of BVH4 node, leaf: index of the first primitive in BVH::indices
+	uint32_t count[4];	// number of primitives in leaf, 0 for inner child and empty slot
+	uint8_t axis[3];	// split axes of the collapsed binary nodes: between child pairs (0,1) and (2,3), inside pair (0,1), inside pair (2,3)
+						// children are ordered so the lower one along the axis comes first, ray direction sign then gives near-to-far order
+};
+
+const uint32_t max_sphere_batch = 8;	// most spheres tested against a ray at once, 8 with AVX, 4 with SSE or scalar code
+
+// AVX needs the CPU to have it and the OS to save ymm registers on context switch
+bool cpu_has_avx()
+{
+#if PATHTRACER_AVX && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6) == 6;	// OSXSAVE, AVX, ymm state saved
+#elif PATHTRACER_AVX
+	return __builtin_cpu_supports("avx");
+#else
+	return false;
+#endif
+}
+
+// sphere positions and squared radii as structure of arrays, in BVH leaf order, so a leaf's spheres are loaded straight into SIMD registers
+// arrays are padded with max_sphere_batch extra elements, so the last batch of the last leaf never reads past the end
+struct SphereTable
+{
+	std::vector<float> x;
+	std::vector<float> y;
+	std::vector<float> z;
+	std::vector<float> radius2;
+	uint32_t batch;		// number of spheres tested against a ray at once, picked when BVH is built
+};
+
+struct BVH
+{
+	std::vector<BVHNode> nodes;		// nodes[0] is the root
+	std::vector<uint32_t> indices;	// sphere indices, sorted so every leaf references a continuous range
+	std::vector<BVH4Node> wide;		// the same tree collapsed to 4-wide nodes, used for tracing, wide[0] is the root
+	SphereTable spheres;			// spheres[i] is scene sphere indices[i]
+};
+
+struct Scene
+{
+	std::vector<Sphere> spheres;	// bounded primitives, found through the BVH
+	std::vector<Plane> planes;		// infinite primitives, can't be bounded by a box so they stay outside the BVH
+	BVH bvh;
+};
+
+const uint32_t bvh_max_leaf_size = 8;	// nodes with more primitives are always split
+const uint32_t bvh_max_depth = 48;		// deeper nodes become leaves no matter the size, keeps traversal stack bounded
+const uint32_t bvh_bins = 16;			// number of candidate split positions per axis
+const float bvh_traversal_cost = 1.0f;	// cost of testing a box relative to testing a primitive
+
+// half of box surface area, the probability of a random ray hitting the box is proportional to it
+float half_area(AABB box)
+{
+	Vec3 e = sub(box.max, box.min);
+	if (e.x < 0.0f || e.y < 0.0f || e.z < 0.0f)
+		return 0.0f;
+	return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+struct BVHBuilder
+{
+	BVH* bvh;
+	std::vector<AABB> boxes;		// bounds of each primitive
+	std::vector<Vec3> centers;		// center of each primitive's box
+	std::atomic<uint32_t> num_nodes;	// children are allocated from preallocated bvh->nodes, so threads can build subtrees at the same time
+};
+
+// range of primitives that still needs its subtree built
+struct BVHBuildTask
+{
+	uint32_t node;
+	uint32_t first;
+	uint32_t count;
+	uint32_t depth;
+};
+
+struct BVHBin
+{
+	AABB bounds;
+	uint32_t count;
+};
+
+// turn node into a leaf of primitives [first, first + count), then split it if that's cheaper by Surface Area Heuristic (SAH)
+// returns true when node got split, mid is where the second child's primitives begin
+bool split_bvh_node(BVHBuilder& builder, uint32_t node_index, uint32_t first, uint32_t count, uint32_t depth, uint32_t& mid)
+{
+	BVH& bvh = *builder.bvh;
+
+	AABB box = empty_aabb();
+	AABB centers = empty_aabb();
+	for (uint32_t i = first; i < first + count; ++i)
 	{
-		jobs[t].join();
-		printf("- job %i ready.\n", t);
+		uint32_t prim = bvh.indices[i];
+		box = merge(box, builder.boxes[prim]);
+		centers = merge(centers, { builder.centers[prim], builder.centers[prim] });
 	}
-	printf("Render done.\n");
 
-	// save image to 'render.png'
-	int32_t res = stbi_write_png("render.png", width, height, 3, image, stride * width);
+	BVHNode& node = bvh.nodes[node_index];
+	node.bounds = box;
+	node.first = first;
+	node.count = count;
 
-	if (res)
-		printf("\nSaved to render.png\n");
-	else
-		printf("\nCannot save to render.png\n");
+	if (count <= 1 || depth >= bvh_max_depth)
+		return false;
 
-	// release image memory
-	free(image);
+	// sort primitives into bins along each axis, and check the cost of splitting between every two neighbouring bins:
+	// cost = traversal + (area_left * count_left + area_right * count_right) / area_parent
+	float best_cost = 1e30f;
+	uint32_t best_axis = 0;
+	uint32_t best_bin = 0;
+
+	for (uint32_t a = 0; a < 3; ++a)
+	{
+		float c_min = axis(centers.min, a);
+		float c_extent = axis(centers.max, a) - c_min;
+		if (c_extent <= 0.0f)
+			continue;
+
+		BVHBin bins[bvh_bins];
+		for (uint32_t b = 0; b < bvh_bins; ++b)
+		{
+			bins[b].bounds = empty_aabb();
+			bins[b].count = 0;
+		}
+
+		float scale = bvh_bins / c_extent;
+		for (uint32_t i = first; i < first + count; ++i)
+		{
+			uint32_t prim = bvh.indices[i];
+			uint32_t b = std::min(bvh_bins - 1, (uint32_t)((axis(builder.centers[prim], a) - c_min) * scale));
+			bins[b].bounds = merge(bins[b].bounds, builder.boxes[prim]);
+			bins[b].count++;
+		}
+
+		// sweep from the right to get area and count of everything right of each split
+		float right_area[bvh_bins];
+		uint32_t right_count[bvh_bins];
+		AABB right = empty_aabb();
+		uint32_t n = 0;
+		for (uint32_t b = bvh_bins - 1; b > 0; --b)
+		{
+			right = merge(right, bins[b].bounds);
+			n += bins[b].count;
+			right_area[b] = half_area(right);
+			right_count[b] = n;
+		}
+
+		// sweep from the left, split b means bins [0, b) go left
+		AABB left = empty_aabb();
+		n = 0;
+		for (uint32_t b = 1; b < bvh_bins; ++b)
+		{
+			left = merge(left, bins[b - 1].bounds);
+			n += bins[b - 1].count;
+			float cost = half_area(left) * n + right_area[b] * right_count[b];
+			if (n > 0 && right_count[b] > 0 && cost < best_cost)
+			{
+				best_cost = cost;
+				best_axis = a;
+				best_bin = b;
+			}
+		}
+	}
+
+	float area = half_area(box);
+	float split_cost = bvh_traversal_cost + (area > 0.0f ? best_cost / area : 0.0f);
+	float leaf_cost = (float)((count + bvh.spheres.batch - 1) / bvh.spheres.batch);	// leaf spheres are tested in batches, each about as costly as one test
+	bool found_split = best_cost < 1e30f;
+
+	if (count <= bvh_max_leaf_size && (!found_split || split_cost >= leaf_cost))
+		return false;
+
+	if (found_split)
+	{
+		// partition primitives, the ones in bins left of split go first
+		float c_min = axis(centers.min, best_axis);
+		float scale = bvh_bins / (axis(centers.max, best_axis) - c_min);
+
+		mid = first;
+		for (uint32_t i = first; i < first + count; ++i)
+		{
+			uint32_t prim = bvh.indices[i];
+			uint32_t b = std::min(bvh_bins - 1, (uint32_t)((axis(builder.centers[prim], best_axis) - c_min) * scale));
+			if (b < best_bin)
+			{
+				std::swap(bvh.indices[i], bvh.indices[mid]);
+				mid++;
+			}
+		}
+	}
+	else
+	{
+		// all centers in the same place, nothing to split by, fall back to halving the range
+		mid = first + count / 2;
+	}
+
+	uint32_t left = builder.num_nodes.fetch_add(2);
+	node.first = left;
+	node.count = 0;
+
+	return true;
+}
+
+void build_bvh_subtree(BVHBuilder& builder, BVHBuildTask task)
+{
+	uint32_t mid = 0;
+	if (!split_bvh_node(builder, task.node, task.first, task.count, task.depth, mid))
+		return;
+
+	uint32_t left = builder.bvh->nodes[task.node].first;
+	build_bvh_subtree(builder, { left, task.first, mid - task.first, task.depth + 1 });
+	build_bvh_subtree(builder, { left + 1, mid, task.first + task.count - mid, task.depth + 1 });
+}
+
+Vec3 center(AABB box)
+{
+	return mul(add(box.min, box.max), 0.5f);
+}
+
+// axis along which centers of two boxes are the furthest apart, swaps a and b if b is the lower one along it
+uint32_t order_along_axis(const BVH& bvh, uint32_t& a, uint32_t& b)
+{
+	Vec3 d = sub(center(bvh.nodes[b].bounds), center(bvh.nodes[a].bounds));
+	Vec3 e = { fabsf(d.x), fabsf(d.y), fabsf(d.z) };
+	uint32_t split_axis = e.x > e.y ? (e.x > e.z ? 0 : 2) : (e.y > e.z ? 1 : 2);
+
+	if (axis(d, split_axis) < 0.0f)
+		std::swap(a, b);
+
+	return split_axis;
+}
+
+uint32_t collapse_bvh_node(BVH& bvh, uint32_t node_index);
+
+// put binary node into one slot of BVH4 node
+void set_bvh4_child(BVH& bvh, uint32_t wide_index, uint32_t slot, uint32_t node_index)
+{
+	const BVHNode node = bvh.nodes[node_index];
+
+	uint32_t child = node.count > 0 ? node.first : collapse_bvh_node(bvh, node_index);
+
+	BVH4Node& wide = bvh.wide[wide_index];	// collapsing the child may reallocate the array, so don't hold on to it before
+	wide.min_x[slot] = node.bounds.min.x;
+	wide.min_y[slot] = node.bounds.min.y;
+	wide.min_z[slot] = node.bounds.min.z;
+	wide.max_x[slot] = node.bounds.max.x;
+	wide.max_y[slot] = node.bounds.max.y;
+	wide.max_z[slot] = node.bounds.max.z;
+	wide.child[slot] = child;
+	wide.count[slot] = node.count;
+}
+
+// make BVH4 node from binary inner node and its grandchildren, returns its index
+uint32_t collapse_bvh_node(BVH& bvh, uint32_t node_index)
+{
+	uint32_t wide_index = (uint32_t)bvh.wide.size();
+
+	// empty slots get a point box infinitely far away, no ray ever reaches it, so SIMD test doesn't need extra mask
+	BVH4Node empty = {};
+	for (uint32_t i = 0; i < 4; ++i)
+	{
+		empty.min_x[i] = empty.min_y[i] = empty.min_z[i] = 1e30f;
+		empty.max_x[i] = empty.max_y[i] = empty.max_z[i] = 1e30f;
+	}
+	bvh.wide.push_back(empty);
+
+	uint32_t halves[2] = { bvh.nodes[node_index].first, bvh.nodes[node_index].first + 1 };
+	bvh.wide[wide_index].axis[0] = (uint8_t)order_along_axis(bvh, halves[0], halves[1]);
+
+	for (uint32_t h = 0; h < 2; ++h)
+	{
+		const BVHNode half = bvh.nodes[halves[h]];
+
+		if (half.count > 0)
+		{
+			// leaf can't be opened, it takes one slot and the other stays empty
+			bvh.wide[wide_index].axis[1 + h] = 0;
+			set_bvh4_child(bvh, wide_index, 2 * h, halves[h]);
+		}
+		else
+		{
+			uint32_t pair[2] = { half.first, half.first + 1 };
+			bvh.wide[wide_index].axis[1 + h] = (uint8_t)order_along_axis(bvh, pair[0], pair[1]);
+			set_bvh4_child(bvh, wide_index, 2 * h, pair[0]);
+			set_bvh4_child(bvh, wide_index, 2 * h + 1, pair[1]);
+		}
+	}
+
+	return wide_index;
+}
+
+// convert binary tree to 4-wide one
+void collapse_bvh(BVH& bvh)
+{
+	bvh.wide.clear();
+
+	if (bvh.nodes.empty())
+		return;
+
+	if (bvh.nodes[0].count > 0)
+	{
+		// whole tree is a single leaf, wrap it in a node with one child
+		BVH4Node root = {};
+		for (uint32_t i = 0; i < 4; ++i)
+		{
+			root.min_x[i] = root.min_y[i] = root.min_z[i] = 1e30f;
+			root.max_x[i] = root.max_y[i] = root.max_z[i] = 1e30f;
+		}
+		bvh.wide.push_back(root);
+		set_bvh4_child(bvh, 0, 0, 0);
+		return;
+	}
+
+	bvh.wide.reserve(bvh.nodes.size() / 3 + 1);
+	collapse_bvh_node(bvh, 0);
+}
+
+// build BVH over scene spheres with binned SAH, returns build time in seconds
+// top of the tree is split on calling thread until there are enough subtrees to keep all threads busy, then the subtrees are built in parallel
+double build_bvh(Scene& scene, uint32_t num_threads)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	BVH& bvh = scene.bvh;
+	uint32_t count = (uint32_t)scene.spheres.size();
+
+	BVHBuilder builder;
+	builder.bvh = &bvh;
+	builder.boxes.resize(count);
+	builder.centers.resize(count);
+	builder.num_nodes = 1;
+
+	bvh.indices.resize(count);
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		bvh.indices[i] = i;
+		builder.boxes[i] = bounds(scene.spheres[i]);
+		builder.centers[i] = scene.spheres[i].pos;
+	}
+
+	bvh.nodes.clear();
+	bvh.wide.clear();
+	bvh.spheres = {};
+	bvh.spheres.batch = cpu_has_avx() ? 8 : 4;
+	if (count == 0)
+		return 0.0;
+
+	bvh.nodes.resize(2 * count - 1);	// binary tree with at least one primitive per leaf never has more nodes
+
+	// split the biggest range until there are a few tasks per thread, or the ranges become too small to bother
+	const uint32_t min_task_size = 1024;
+	const uint32_t target_tasks = num_threads > 1 ? 4 * num_threads : 1;
+
+	std::vector<BVHBuildTask> tasks;
+	tasks.push_back({ 0, 0, count, 0 });
+
+	while (tasks.size() < target_tasks)
+	{
+		size_t biggest = 0;
+		for (size_t i = 1; i < tasks.size(); ++i)
+		{
+			if (tasks[i].count > tasks[biggest].count)
+				biggest = i;
+		}
+
+		BVHBuildTask task = tasks[biggest];
+		if (task.count < min_task_size)
+			break;
+
+		tasks.erase(tasks.begin() + biggest);
+
+		uint32_t mid = 0;
+		if (split_bvh_node(builder, task.node, task.first, task.count, task.depth, mid))
+		{
+			uint32_t left = bvh.nodes[task.node].first;
+			tasks.push_back({ left, task.first, mid - task.first, task.depth + 1 });
+			tasks.push_back({ left + 1, mid, task.first + task.count - mid, task.depth + 1 });
+		}
+	}
+
+	// biggest first, so the small ones fill the gaps at the end
+	std::sort(tasks.begin(), tasks.end(), [](const BVHBuildTask& a, const BVHBuildTask& b) { return a.count > b.count; });
+
+	std::atomic<uint32_t> next_task(0);
+	uint32_t num_workers = std::min(num_threads, (uint32_t)tasks.size());
+
+	parallel_run(num_workers, [&](uint32_t) {
+		for (uint32_t i = next_task++; i < tasks.size(); i = next_task++)
+		{
+			build_bvh_subtree(builder, tasks[i]);
+		}
+	});
+
+	bvh.nodes.resize(builder.num_nodes);
+	collapse_bvh(bvh);
+
+	// copy sphere shapes in leaf order, padding never hits anything (negative squared radius)
+	SphereTable& table = bvh.spheres;
+	table.x.assign(count + max_sphere_batch, 0.0f);
+	table.y.assign(count + max_sphere_batch, 0.0f);
+	table.z.assign(count + max_sphere_batch, 0.0f);
+	table.radius2.assign(count + max_sphere_batch, -1.0f);
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		const Sphere& sphere = scene.spheres[bvh.indices[i]];
+		table.x[i] = sphere.pos.x;
+		table.y[i] = sphere.pos.y;
+		table.z[i] = sphere.pos.z;
+		table.radius2[i] = sphere.radius * sphere.radius;
+	}
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count();
+}
+
+// tree quality statistics, the lower SAH cost the faster the tree is to trace
+struct BVHStats
+{
+	uint32_t num_nodes;
+	uint32_t num_leaves;
+	uint32_t max_depth;
+	uint32_t min_leaf_size;
+	uint32_t max_leaf_size;
+	float avg_leaf_size;
+	float sah_cost;		// expected cost of tracing a random ray through the tree, in primitive tests
+};
+
+BVHStats measure_bvh(const BVH& bvh)
+{
+	BVHStats stats = {};
+	if (bvh.nodes.empty())
+		return stats;
+
+	stats.num_nodes = (uint32_t)bvh.nodes.size();
+	stats.min_leaf_size = 0xffffffff;
+
+	float root_area = half_area(bvh.nodes[0].bounds);
+	float inv_root_area = root_area > 0.0f ? 1.0f / root_area : 0.0f;
+	uint32_t num_prims = 0;
+
+	// walk the whole tree, node index and depth
+	std::vector<uint32_t> stack;
+	stack.push_back(0);
+	stack.push_back(0);
+
+	while (!stack.empty())
+	{
+		uint32_t depth = stack.back();
+		stack.pop_back();
+		const BVHNode& node = bvh.nodes[stack.back()];
+		stack.pop_back();
+
+		float probability = half_area(node.bounds) * inv_root_area;
+		stats.max_depth = std::max(stats.max_depth, depth);
+
+		if (node.count > 0)
+		{
+			stats.num_leaves++;
+			stats.min_leaf_size = std::min(stats.min_leaf_size, node.count);
+			stats.max_leaf_size = std::max(stats.max_leaf_size, node.count);
+			stats.sah_cost += probability * node.count;
+			num_prims += node.count;
+		}
+		else
+		{
+			stats.sah_cost += probability * bvh_traversal_cost;
+			stack.push_back(node.first);
+			stack.push_back(depth + 1);
+			stack.push_back(node.first + 1);
+			stack.push_back(depth + 1);
+		}
+	}
+
+	stats.avg_leaf_size = num_prims / (float)stats.num_leaves;
+	return stats;
+}
+
+void print_bvh_stats(const BVH& bvh, double build_time)
+{
+	BVHStats stats = measure_bvh(bvh);
+	printf("BVH: %u primitives, built in %.2f ms\n", (uint32_t)bvh.indices.size(), build_time * 1000.0);
+	printf("- nodes: %u, leaves: %u, max depth: %u\n", stats.num_nodes, stats.num_leaves, stats.max_depth);
+	printf("- leaf size: min %u, avg %.2f, max %u\n", stats.num_leaves ? stats.min_leaf_size : 0, stats.avg_leaf_size, stats.max_leaf_size);
+	printf("- SAH cost: %.2f\n", stats.sah_cost);
+}
+
+// ray prepared for testing against four boxes at once
+struct WideRay
+{
+#if PATHTRACER_SSE
+	__m128 pos_x, pos_y, pos_z;
+	__m128 inv_dir_x, inv_dir_y, inv_dir_z;
+#endif
+	Ray ray;
+	Vec3 inv_dir;
+	uint32_t negative[3];	// 1 if ray goes toward negative direction along axis, selects which child of a pair is nearer
+};
+
+WideRay make_wide_ray(Ray ray)
+{
+	WideRay wide;
+	wide.ray = ray;
+	wide.inv_dir = { 1.0f / ray.dir.x, 1.0f / ray.dir.y, 1.0f / ray.dir.z };
+	wide.negative[0] = ray.dir.x < 0.0f;
+	wide.negative[1] = ray.dir.y < 0.0f;
+	wide.negative[2] = ray.dir.z < 0.0f;
+#if PATHTRACER_SSE
+	wide.pos_x = _mm_set1_ps(ray.pos.x);
+	wide.pos_y = _mm_set1_ps(ray.pos.y);
+	wide.pos_z = _mm_set1_ps(ray.pos.z);
+	wide.inv_dir_x = _mm_set1_ps(wide.inv_dir.x);
+	wide.inv_dir_y = _mm_set1_ps(wide.inv_dir.y);
+	wide.inv_dir_z = _mm_set1_ps(wide.inv_dir.z);
+#endif
+	return wide;
+}
+
+// test ray against all four child boxes of node, returns bit mask of the children hit closer than max_distance
+uint32_t intersect(const WideRay& ray, const BVH4Node& node, float max_distance)
+{
+	PATHTRACER_STAT(thread_stats->node_tests++);
+
+#if PATHTRACER_SSE
+	__m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_x), ray.pos_x), ray.inv_dir_x);
+	__m128 tx2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_x), ray.pos_x), ray.inv_dir_x);
+	__m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_y), ray.pos_y), ray.inv_dir_y);
+	__m128 ty2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_y), ray.pos_y), ray.inv_dir_y);
+	__m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_z), ray.pos_z), ray.inv_dir_z);
+	__m128 tz2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_z), ray.pos_z), ray.inv_dir_z);
+
+	__m128 t_enter = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx1, tx2), _mm_min_ps(ty1, ty2)), _mm_min_ps(tz1, tz2));
+	__m128 t_exit = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx1, tx2), _mm_max_ps(ty1, ty2)), _mm_max_ps(tz1, tz2));
+
+	__m128 hit = _mm_and_ps(_mm_cmpge_ps(t_exit, _mm_max_ps(t_enter, _mm_setzero_ps())), _mm_cmplt_ps(t_enter, _mm_set1_ps(max_distance)));
+	return (uint32_t)_mm_movemask_ps(hit);
+#else
+	uint32_t mask = 0;
+	for (uint32_t i = 0; i < 4; ++i)
+	{
+		AABB box = { { node.min_x[i], node.min_y[i], node.min_z[i] }, { node.max_x[i], node.max_y[i], node.max_z[i] } };
+		if (intersect(ray.ray, ray.inv_dir, box, max_distance))
+			mask |= 1u << i;
+	}
+	return mask;
+#endif
+}
+
+// hits are rare, so finding the nearest one among the lanes is left to scalar code
+inline bool nearest_lane(uint32_t mask, const float* t, uint32_t i, float& distance, uint32_t& index)
+{
+	bool is_hit = false;
+	for (uint32_t lane = 0; mask != 0; ++lane, mask >>= 1)
+	{
+		if ((mask & 1) && t[lane] < distance)
+		{
+			distance = t[lane];
+			index = i + lane;
+			is_hit = true;
+		}
+	}
+	return is_hit;
+}
+
+#if PATHTRACER_AVX
+// 8 spheres at a time, only called when the CPU has AVX
+PATHTRACER_TARGET_AVX bool intersect_avx(const WideRay& ray, const SphereTable& table, uint32_t first, uint32_t count, float& distance, uint32_t& index)
+{
+	bool is_hit = false;
+
+	for (uint32_t i = first; i < first + count; i += 8)
+	{
+		uint32_t valid = count - (i - first) >= 8 ? 0xff : (1u << (count - (i - first))) - 1;
+		float t[8];
+
+		__m256 dx = _mm256_set1_ps(ray.ray.dir.x);
+		__m256 dy = _mm256_set1_ps(ray.ray.dir.y);
+		__m256 dz = _mm256_set1_ps(ray.ray.dir.z);
+		__m256 cx = _mm256_sub_ps(_mm256_loadu_ps(&table.x[i]), _mm256_set1_ps(ray.ray.pos.x));
+		__m256 cy = _mm256_sub_ps(_mm256_loadu_ps(&table.y[i]), _mm256_set1_ps(ray.ray.pos.y));
+		__m256 cz = _mm256_sub_ps(_mm256_loadu_ps(&table.z[i]), _mm256_set1_ps(ray.ray.pos.z));
+		__m256 r2 = _mm256_loadu_ps(&table.radius2[i]);
+
+		__m256 t1 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, cx), _mm256_mul_ps(dy, cy)), _mm256_mul_ps(dz, cz));
+		__m256 ex = _mm256_sub_ps(_mm256_mul_ps(dy, cz), _mm256_mul_ps(dz, cy));
+		__m256 ey = _mm256_sub_ps(_mm256_mul_ps(dz, cx), _mm256_mul_ps(dx, cz));
+		__m256 ez = _mm256_sub_ps(_mm256_mul_ps(dx, cy), _mm256_mul_ps(dy, cx));
+		__m256 d2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ex, ex), _mm256_mul_ps(ey, ey)), _mm256_mul_ps(ez, ez));
+
+		__m256 hit = _mm256_and_ps(_mm256_cmp_ps(t1, _mm256_setzero_ps(), _CMP_GT_OQ), _mm256_cmp_ps(d2, r2, _CMP_LE_OQ));
+		__m256 dist = _mm256_sub_ps(t1, _mm256_sqrt_ps(_mm256_max_ps(_mm256_sub_ps(r2, d2), _mm256_setzero_ps())));
+		hit = _mm256_and_ps(hit, _mm256_cmp_ps(dist, _mm256_set1_ps(distance), _CMP_LT_OQ));
+
+		uint32_t mask = (uint32_t)_mm256_movemask_ps(hit) & valid;
+		_mm256_storeu_ps(t, dist);
+
+		if (nearest_lane(mask, t, i, distance, index))
+			is_hit = true;
+	}
+
+	return is_hit;
+}
+#endif
+
+// test ray against spheres [first, first + count) of the table, table.batch of them at a time
+// only the distance of the nearest hit and its index are kept, if it's closer than distance
+bool intersect(const WideRay& ray, const SphereTable& table, uint32_t first, uint32_t count, float& distance, uint32_t& index)
+{
+	PATHTRACER_STAT(thread_stats->sphere_tests += count);
+
+#if PATHTRACER_AVX
+	if (table.batch == 8)
+		return intersect_avx(ray, table, first, count, distance, index);
+#endif
+
+	bool is_hit = false;
+
+	for (uint32_t i = first; i < first + count; i += 4)
+	{
+		uint32_t valid = count - (i - first) >= 4 ? 0xf : (1u << (count - (i - first))) - 1;
+		float t[4];
+
+		// hit when sphere center is in front of the ray and no farther from the ray than radius, squared distance is taken from the cross product
+#if PATHTRACER_SSE
+		__m128 dx = _mm_set1_ps(ray.ray.dir.x);
+		__m128 dy = _mm_set1_ps(ray.ray.dir.y);
+		__m128 dz = _mm_set1_ps(ray.ray.dir.z);
+		__m128 cx = _mm_sub_ps(_mm_loadu_ps(&table.x[i]), ray.pos_x);
+		__m128 cy = _mm_sub_ps(_mm_loadu_ps(&table.y[i]), ray.pos_y);
+		__m128 cz = _mm_sub_ps(_mm_loadu_ps(&table.z[i]), ray.pos_z);
+		__m128 r2 = _mm_loadu_ps(&table.radius2[i]);
+
+		__m128 t1 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, cx), _mm_mul_ps(dy, cy)), _mm_mul_ps(dz, cz));
+		__m128 ex = _mm_sub_ps(_mm_mul_ps(dy, cz), _mm_mul_ps(dz, cy));
+		__m128 ey = _mm_sub_ps(_mm_mul_ps(dz, cx), _mm_mul_ps(dx, cz));
+		__m128 ez = _mm_sub_ps(_mm_mul_ps(dx, cy), _mm_mul_ps(dy, cx));
+		__m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ex, ex), _mm_mul_ps(ey, ey)), _mm_mul_ps(ez, ez));
+
+		__m128 hit = _mm_and_ps(_mm_cmpgt_ps(t1, _mm_setzero_ps()), _mm_cmple_ps(d2, r2));
+		__m128 dist = _mm_sub_ps(t1, _mm_sqrt_ps(_mm_max_ps(_mm_sub_ps(r2, d2), _mm_setzero_ps())));
+		hit = _mm_and_ps(hit, _mm_cmplt_ps(dist, _mm_set1_ps(distance)));
+
+		uint32_t mask = (uint32_t)_mm_movemask_ps(hit) & valid;
+		_mm_storeu_ps(t, dist);
+#else
+		uint32_t mask = 0;
+		for (uint32_t lane = 0; lane < 4; ++lane)
+		{
+			Vec3 c = { table.x[i + lane] - ray.ray.pos.x, table.y[i + lane] - ray.ray.pos.y, table.z[i + lane] - ray.ray.pos.z };
+			Vec3 e = cross(ray.ray.dir, c);
+			float t1 = dot(ray.ray.dir, c);
+			float d2 = dot(e, e);
+			float r2 = table.radius2[i + lane];
+
+			t[lane] = t1 - sqrtf(fmaxf(r2 - d2, 0.0f));
+			if (t1 > 0.0f && d2 <= r2 && t[lane] < distance)
+				mask |= 1u << lane;
+		}
+		mask &= valid;
+#endif
+
+		if (nearest_lane(mask, t, i, distance, index))
+			is_hit = true;
+	}
+
+	return is_hit;
+}
+
+bool intersect(Ray ray, Scene& scene, Hit& hit)
+{
+	Hit temp_hit = {};
+	float distance = 10000.0f;
+	bool is_hit = false;
+
+	// infinite primitives first, they narrow down the distance for the BVH
+	for (const Plane& plane : scene.planes)
+	{
+		if (intersect(ray, plane, temp_hit) && temp_hit.distance < distance)
+		{
+			hit = temp_hit;
+			distance = temp_hit.distance;
+			is_hit = true;
+		}
+	}
+
+	if (scene.bvh.wide.empty())
+		return is_hit;
+
+	WideRay wide_ray = make_wide_ray(ray);
+
+	// only the nearest sphere and its distance are tracked during traversal, full hit is filled in once at the end
+	uint32_t sphere_index = 0;
+	bool is_sphere_hit = false;
+
+	// walk the tree, skipping every subtree whose box is missed or is further than the closest hit so far
+	uint32_t stack[128];
+	uint32_t stack_size = 0;
+	stack[stack_size++] = 0;
+
+	while (stack_size > 0)
+	{
+		const BVH4Node& node = scene.bvh.wide[stack[--stack_size]];
+
+		uint32_t mask = intersect(wide_ray, node, distance);
+		if (mask == 0)
+			continue;
+
+		// children from near to far, based on which way the ray goes along the split axes
+		uint32_t first_half = wide_ray.negative[node.axis[0]];
+		uint32_t order[4];
+		for (uint32_t h = 0; h < 2; ++h)
+		{
+			uint32_t half = h ^ first_half;
+			uint32_t first = wide_ray.negative[node.axis[1 + half]];
+			order[2 * h] = 2 * half + first;
+			order[2 * h + 1] = 2 * half + (first ^ 1);
+		}
+
+		// leaves are tested right away, nearest first, inner nodes go to the stack so that the nearest is taken next
+		uint32_t inner[4];
+		uint32_t num_inner = 0;
+
+		for (uint32_t i = 0; i < 4; ++i)
+		{
+			uint32_t slot = order[i];
+			if ((mask & (1u << slot)) == 0)
+				continue;
+
+			if (node.count[slot] > 0)
+			{
+				if (intersect(wide_ray, scene.bvh.spheres, node.child[slot], node.count[slot], distance, sphere_index))
+				{
+					is_sphere_hit = true;
+				}
+			}
+			else
+			{
+				inner[num_inner++] = node.child[slot];
+			}
+		}
+
+		while (num_inner > 0)
+		{
+			stack[stack_size++] = inner[--num_inner];
+		}
+	}
+
+	if (is_sphere_hit)
+	{
+		fill_hit(ray, scene.spheres[scene.bvh.indices[sphere_index]], distance, hit);
+		is_hit = true;
+	}
+
+	return is_hit;
+}
+
+// white-blue gradient, what rays that don't hit anything see
+Vec3 background(Vec3 dir)
+{
+	Vec3 white = { 1.0f, 1.0f, 1.0f };
+	Vec3 blue = { 0.5f, 0.7f, 1.0f };
+	float t = saturate(0.5f * (dir.y + 1.0f));
+	return add(mul(white, t), mul(blue, 1.0f - t));
+}
+
+const uint32_t roulette_depth = 3;	// bounces before paths may get terminated by Russian roulette
+
+// ray hit a surface, absorb some light and bounce it, returns false if Russian roulette terminated the path
+// Russian roulette: path carrying little light is likely to stop here, the surviving ones carry more to stay unbiased
+bool scatter(Ray& ray, const Hit& hit, uint32_t depth, Vec3& throughput, Sampler& sampler)
+{
+	throughput = mul(throughput, hit.color);
+
+	if (depth >= roulette_depth)
+	{
+		float survival = fminf(fmaxf(throughput.x, fmaxf(throughput.y, throughput.z)), 1.0f);
+		if (randf(sampler) >= survival)
+		{
+			return false;
+		}
+
+		throughput = mul(throughput, 1.0f / survival);
+	}
+
+	Vec3 reflected = reflect(ray.dir, hit.normal);
+
+	ray.pos = hit.pos;
+	ray.dir = reflected;
+	adjust(ray);
+	perturb(ray, hit.roughness, sampler);
+
+	return true;
+}
+
+// num_rays counts rays traced against the scene, for throughput stats
+Vec3 path_tracing(Ray ray, Scene& scene, uint32_t bounces, Sampler& sampler, uint64_t& num_rays)
+{
+	// how much light coming along current ray contributes to the pixel, every bounce absorbs some
+	Vec3 throughput = { 1.0f, 1.0f, 1.0f };
+
+	for (uint32_t depth = 0;; ++depth)
+	{
+		// if ray doesn't hit anything, or we're out of bounces, return background color
+		if (depth == bounces)
+		{
+			PATHTRACER_STAT(thread_stats->bounce_limit++);
+			return mul(throughput, background(ray.dir));
+		}
+
+		Hit hit = {};
+		++num_rays;
+		PATHTRACER_STAT(thread_stats->rays[std::min(depth, stats_max_depth - 1)]++);
+		if (!intersect(ray, scene, hit))
+		{
+			PATHTRACER_STAT(thread_stats->misses++);
+			return mul(throughput, background(ray.dir));
+		}
+
+		PATHTRACER_STAT(thread_stats->hits++);
+		if (!scatter(ray, hit, depth, throughput, sampler))
+		{
+			PATHTRACER_STAT(thread_stats->roulette++);
+			return { 0.0f, 0.0f, 0.0f };
+		}
+	}
+}
+
+// ray from camera through random position inside pixel x, y
+Ray camera_ray(uint32_t x, uint32_t y, uint32_t width, uint32_t height, Sampler& sampler)
+{
+	// camera
+	Vec3 camera_pos = { 0.0f, 0.0f, -3.0f };
+	float camera_near = 0.5f;	// distance from camera position to the near plane of the camera
+
+	// pixel position is on the camera near plane
+	float aspect_ratio = width / (float)height;
+	Vec3 pixel_pos = {
+		aspect_ratio * (float)x / (float)width - (aspect_ratio - 1.0f) * 0.5f - 0.5f,
+		(float)y / (float)height - 0.5f,
+		camera_pos.z + camera_near
+	};
+
+	float sub_x = aspect_ratio / width;
+	float sub_y = 1.0f / height;
+
+	Vec3 rand_pixel_pos = pixel_pos;
+	rand_pixel_pos.x += randf(sampler) * sub_x - 0.5f * sub_x;
+	rand_pixel_pos.y += randf(sampler) * sub_y - 0.5f * sub_y;
+
+	// ray starting at pixel position
+	Ray ray;
+	ray.pos = rand_pixel_pos;
+	ray.dir = norm(sub(rand_pixel_pos, camera_pos));
+	return ray;
+}
+
+// running estimate of a pixel, sum of its samples plus mean and variance of their luminance
+// mean and variance are updated with Welford's algorithm, which stays precise even after many samples
+struct PixelEstimate
+{
+	Vec3 sum;		// sum of sample colors
+	uint32_t count;	// number of samples taken
+	float mean;		// mean luminance
+	float m2;		// sum of squared differences from the mean luminance
+};
+
+float luminance(Vec3 color)
+{
+	return 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+}
+
+void add_sample(PixelEstimate& estimate, Vec3 color)
+{
+	estimate.sum = add(estimate.sum, color);
+	estimate.count++;
+
+	float l = luminance(color);
+	float delta = l - estimate.mean;
+	estimate.mean += delta / estimate.count;
+	estimate.m2 += delta * (l - estimate.mean);
+}
+
+// standard error of the mean luminance relative to the mean itself, how far from the true value the pixel probably is
+float relative_error(const PixelEstimate& estimate)
+{
+	if (estimate.count < 2)
+		return 1e30f;
+
+	float variance = estimate.m2 / (estimate.count - 1);
+	return sqrtf(variance / estimate.count) / fmaxf(estimate.mean, 0.01f);
+}
+
+Vec3 resolve(const PixelEstimate& estimate)
+{
+	return mul(estimate.sum, 1.0f / (float)estimate.count);
+}
+
+// how pixels of the framebuffer are laid out in memory
+enum FramebufferLayout
+{
+	layout_scanline,		// row after row, tiles next to each other share cache lines at their edges
+	layout_tiles,			// tile after tile, in scanline order of tiles, each tile is a block of whole cache lines
+	layout_tiles_morton,	// same, but tiles in Morton (Z) order, so tiles close in the image are close in memory too
+};
+
+const uint32_t cache_line_size = 64;
+
+// linear float image that all samples are accumulated into, converted to 8-bit only for output
+// pixels keep their sums between renders, so more samples can be added later instead of starting over
+// in tiled layouts a tile's pixels are written only by the worker rendering it, no other worker writes to its cache lines
+struct Framebuffer
+{
+	uint32_t width;
+	uint32_t height;
+	FramebufferLayout layout;
+	uint32_t tile_size;		// same tiles workers render
+	uint32_t tiles_x;		// tiles in a row of the image
+	uint32_t block_size;	// tiled layouts: pixels per tile block, tile_size^2 rounded up to whole cache lines
+	uint32_t* tile_block;	// tiled layouts: block of every tile, tiles are numbered in scanline order
+	uint32_t* block_tile;	// tiled layouts: tile of every block
+	uint32_t num_pixels;	// pixels allocated, with tiles it includes padding and parts of edge tiles outside the image
+	PixelEstimate* pixels;	// aligned to cache line, use pixel_index() to find a pixel
+};
+
+void* alloc_aligned(size_t size, size_t alignment)
+{
+#if defined(_MSC_VER)
+	return _aligned_malloc(size, alignment);
+#else
+	void* memory = NULL;
+	return posix_memalign(&memory, alignment, size) == 0 ? memory : NULL;
+#endif
+}
+
+void free_aligned(void* memory)
+{
+#if defined(_MSC_VER)
+	_aligned_free(memory);
+#else
+	free(memory);
+#endif
+}
+
+// bits of x and y interleaved, y in odd bits
+uint32_t morton_code(uint32_t x, uint32_t y)
+{
+	uint32_t code = 0;
+	for (uint32_t bit = 0; bit < 16; ++bit)
+	{
+		code |= ((x >> bit) & 1) << (2 * bit) | ((y >> bit) & 1) << (2 * bit + 1);
+	}
+	return code;
+}
+
+uint32_t pixel_index(const Framebuffer& fb, uint32_t x, uint32_t y)
+{
+	if (fb.layout == layout_scanline)
+		return x + y * fb.width;
+
+	uint32_t tx = x / fb.tile_size;
+	uint32_t ty = y / fb.tile_size;
+	uint32_t block = fb.tile_block[tx + ty * fb.tiles_x];
+	return block * fb.block_size + (x - tx * fb.tile_size) + (y - ty * fb.tile_size) * fb.tile_size;
+}
+
+// inverse of pixel_index()
+void pixel_position(const Framebuffer& fb, uint32_t index, uint32_t& x, uint32_t& y)
+{
+	if (fb.layout == layout_scanline)
+	{
+		x = index % fb.width;
+		y = index / fb.width;
+		return;
+	}
+
+	uint32_t tile = fb.block_tile[index / fb.block_size];
+	uint32_t local = index % fb.block_size;
+	x = (tile % fb.tiles_x) * fb.tile_size + local % fb.tile_size;
+	y = (tile / fb.tiles_x) * fb.tile_size + local / fb.tile_size;
+}
+
+// zero pixels of tile rows [row0, row1)
+void clear_tile_rows(Framebuffer& fb, uint32_t row0, uint32_t row1)
+{
+	if (fb.layout == layout_scanline)
+	{
+		uint32_t y0 = std::min(row0 * fb.tile_size, fb.height);
+		uint32_t y1 = std::min(row1 * fb.tile_size, fb.height);
+		memset(&fb.pixels[y0 * fb.width], 0, (y1 - y0) * fb.width * sizeof(PixelEstimate));
+		return;
+	}
+
+	for (uint32_t tile = row0 * fb.tiles_x; tile < row1 * fb.tiles_x; ++tile)
+	{
+		memset(&fb.pixels[fb.tile_block[tile] * fb.block_size], 0, fb.block_size * sizeof(PixelEstimate));
+	}
+}
+
+// tile_size has to be the one tiles are rendered with, numa is optional, with more nodes each node's rows are first written
+// by workers of that node, which render them later too (see schedule_tiles); memory pages are placed on the node of
+// the thread that touches them first, so every node gets its pixels in its own memory
+Framebuffer create_framebuffer(uint32_t width, uint32_t height, FramebufferLayout layout, uint32_t tile_size, const NumaTopology* numa)
+{
+	Framebuffer fb = {};
+	fb.width = width;
+	fb.height = height;
+	fb.layout = layout;
+	fb.tile_size = tile_size;
+	fb.tiles_x = (width + tile_size - 1) / tile_size;
+	fb.num_pixels = width * height;
+
+	uint32_t num_rows = (height + tile_size - 1) / tile_size;
+
+	if (layout != layout_scanline)
+	{
+		uint32_t num_tiles = fb.tiles_x * num_rows;
+
+		fb.block_size = tile_size * tile_size;
+		while (fb.block_size * sizeof(PixelEstimate) % cache_line_size != 0)
+			++fb.block_size;
+
+		fb.num_pixels = num_tiles * fb.block_size;
+		fb.tile_block = (uint32_t*)malloc(num_tiles * sizeof(uint32_t));
+		fb.block_tile = (uint32_t*)malloc(num_tiles * sizeof(uint32_t));
+
+		for (uint32_t tile = 0; tile < num_tiles; ++tile)
+		{
+			fb.block_tile[tile] = tile;
+		}
+
+		if (layout == layout_tiles_morton)
+		{
+			std::stable_sort(fb.block_tile, fb.block_tile + num_tiles, [&](uint32_t a, uint32_t b) {
+				return morton_code(a % fb.tiles_x, a / fb.tiles_x) < morton_code(b % fb.tiles_x, b / fb.tiles_x);
+			});
+		}
+
+		for (uint32_t block = 0; block < num_tiles; ++block)
+		{
+			fb.tile_block[fb.block_tile[block]] = block;
+		}
+	}
+
+	fb.pixels = (PixelEstimate*)alloc_aligned(fb.num_pixels * sizeof(PixelEstimate), cache_line_size);
+
+	if (!has_node_rows(numa, num_rows))
+	{
+		memset(fb.pixels, 0, fb.num_pixels * sizeof(PixelEstimate));
+		return fb;
+	}
+
+	parallel_run((uint32_t)numa->worker_node.size(), [&](uint32_t thread_id) {
+		uint32_t node = numa->worker_node[thread_id];
+		uint32_t first_worker, count;
+		node_workers(*numa, node, first_worker, count);
+
+		// node's tile rows, split evenly between its workers
+		uint32_t first_row = numa->node_rows[node];
+		uint32_t end_row = numa->node_rows[node + 1];
+
+		uint32_t a = first_row + (end_row - first_row) * (thread_id - first_worker) / count;
+		uint32_t b = first_row + (end_row - first_row) * (thread_id - first_worker + 1) / count;
+		clear_tile_rows(fb, a, b);
+	});
+
+	return fb;
+}
+
+// plain scanline framebuffer
+Framebuffer create_framebuffer(uint32_t width, uint32_t height)
+{
+	return create_framebuffer(width, height, layout_scanline, 1, NULL);
+}
+
+void destroy_framebuffer(Framebuffer& fb)
+{
+	free_aligned(fb.pixels);
+	free(fb.tile_block);
+	free(fb.block_tile);
+	fb.pixels = NULL;
+	fb.tile_block = NULL;
+	fb.block_tile = NULL;
+}
+
+// average color of each pixel as linear float RGB, for HDR output
+void resolve_hdr(const Framebuffer& fb, float* image)
+{
+	for (uint32_t y = 0; y < fb.height; ++y)
+	{
+		for (uint32_t x = 0; x < fb.width; ++x)
+		{
+			const PixelEstimate& estimate = fb.pixels[pixel_index(fb, x, y)];
+			Vec3 color = estimate.count > 0 ? resolve(estimate) : Vec3{ 0.0f, 0.0f, 0.0f };
+
+			uint32_t i = x + y * fb.width;
+			image[3 * i + 0] = color.x;
+			image[3 * i + 1] = color.y;
+			image[3 * i + 2] = color.z;
+		}
+	}
+}
+
+// average color of pixels in rows [y0, y1) clamped to [0, 1] and translated to bytes, rows of image are stride bytes apart
+void resolve_ldr_rows(const Framebuffer& fb, uint32_t y0, uint32_t y1, uint8_t* image, uint32_t stride)
+{
+	for (uint32_t y = y0; y < y1; ++y)
+	{
+		uint8_t* row = image + (y - y0) * stride;
+
+		for (uint32_t x = 0; x < fb.width; ++x)
+		{
+			const PixelEstimate& estimate = fb.pixels[pixel_index(fb, x, y)];
+			Vec3 color = estimate.count > 0 ? saturate(resolve(estimate)) : Vec3{ 0.0f, 0.0f, 0.0f };
+
+			row[3 * x + 0] = (uint8_t)(color.x * 255.0f + 0.5f);
+			row[3 * x + 1] = (uint8_t)(color.y * 255.0f + 0.5f);
+			row[3 * x + 2] = (uint8_t)(color.z * 255.0f + 0.5f);
+		}
+	}
+}
+
+// whole frame as 8-bit RGB
+void resolve_ldr(const Framebuffer& fb, uint8_t* image, uint32_t stride)
+{
+	resolve_ldr_rows(fb, 0, fb.height, image, stride);
+}
+
+// pixel is done when it has all the samples it can get, or adaptive sampling found it clean enough
+bool converged(const PixelEstimate& estimate, uint32_t min_samples, uint32_t max_samples, float threshold)
+{
+	return estimate.count >= max_samples || (estimate.count >= min_samples && relative_error(estimate) <= threshold);
+}
+
+// noise estimate for the whole image, average relative error of pixels, each capped at 1 so a few black pixels don't dominate
+float frame_noise(const Framebuffer& fb)
+{
+	double sum = 0.0;
+	for (uint32_t y = 0; y < fb.height; ++y)
+	{
+		for (uint32_t x = 0; x < fb.width; ++x)
+		{
+			sum += fminf(relative_error(fb.pixels[pixel_index(fb, x, y)]), 1.0f);
+		}
+	}
+	return (float)(sum / (fb.width * fb.height));
+}
+
+// what heatmap.png shows, average cost of a sample of each pixel
+enum HeatmapMode
+{
+	heatmap_off,
+	heatmap_time,	// CPU cycles
+	heatmap_rays,	// rays traced, camera ray plus bounces
+	heatmap_tests,	// BVH node and primitive intersection tests, needs PATHTRACER_STATS=1
+};
+
+uint64_t read_cycles()
+{
+#if PATHTRACER_RDTSC
+	return __rdtsc();
+#else
+	return (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// running total of what the heatmap measures, cost of a pixel is the difference before and after its samples
+uint64_t heatmap_counter(HeatmapMode mode, uint64_t num_rays)
+{
+	switch (mode)
+	{
+	case heatmap_time:
+		return read_cycles();
+	case heatmap_rays:
+		return num_rays;
+#if PATHTRACER_STATS
+	case heatmap_tests:
+		return thread_stats->node_tests + thread_stats->sphere_tests + thread_stats->plane_tests;
+#endif
+	default:
+		return 0;
+	}
+}
+
+// black through purple, red and yellow to white, t in [0, 1]
+Vec3 heat_color(float t)
+{
+	const Vec3 keys[] = { {0.0f, 0.0f, 0.0f}, {0.35f, 0.0f, 0.6f}, {0.85f, 0.1f, 0.25f}, {1.0f, 0.7f, 0.0f}, {1.0f, 1.0f, 1.0f} };
+	const uint32_t last = sizeof(keys) / sizeof(keys[0]) - 1;
+
+	float f = saturate(t) * last;
+	uint32_t i = std::min((uint32_t)f, last - 1);
+	return add(mul(keys[i], 1.0f - (f - i)), mul(keys[i + 1], f - i));
+}
+
+// save pixel_cost (summed over all samples of a pixel) divided by sample count as false color image
+// colors are scaled to the 99th percentile, so that few outliers (interrupts, page faults) don't make the rest dark
+bool save_heatmap(const Framebuffer& fb, const uint64_t* pixel_cost, const char* filename, float& white)
+{
+	uint32_t num_pixels = fb.width * fb.height;
+
+	std::vector<float> cost(num_pixels);
+	for (uint32_t i = 0; i < num_pixels; ++i)
+	{
+		cost[i] = pixel_cost[i] / (float)std::max(fb.pixels[pixel_index(fb, i % fb.width, i / fb.width)].count, 1u);
+	}
+
+	std::vector<float> sorted = cost;
+	std::nth_element(sorted.begin(), sorted.begin() + num_pixels * 99 / 100, sorted.end());
+	white = sorted[num_pixels * 99 / 100];
+
+	uint8_t* image = (uint8_t*)malloc(num_pixels * 3);
+	for (uint32_t i = 0; i < num_pixels; ++i)
+	{
+		Vec3 color = heat_color(white > 0.0f ? cost[i] / white : 0.0f);
+		image[i * 3 + 0] = (uint8_t)(255.0f * color.x + 0.5f);
+		image[i * 3 + 1] = (uint8_t)(255.0f * color.y + 0.5f);
+		image[i * 3 + 2] = (uint8_t)(255.0f * color.z + 0.5f);
+	}
+
+	bool saved = stbi_write_png(filename, fb.width, fb.height, 3, image, fb.width * 3) != 0;
+	free(image);
+
+	return saved;
+}
+
+// everything workers need to know about the frame they render
+struct RenderContext
+{
+	uint32_t width;
+	uint32_t height;
+	uint32_t bounces;
+	uint32_t samples;			// samples per pixel, with adaptive sampling it's the average over each tile
+	uint64_t frame_seed;
+	Scene* scene;
+
+	bool wavefront;				// trace paths in big batches stage by stage, instead of one by one
+	bool adaptive;				// stop sampling pixels once they converge, spend the rest of the samples on the noisy ones
+	uint32_t min_samples;		// adaptive: samples every pixel gets before its error is checked
+	uint32_t max_samples;		// adaptive: most samples a noisy pixel can get
+	uint32_t adaptive_step;		// adaptive: samples added to noisy pixels between error checks
+	float adaptive_threshold;	// adaptive: relative error at which pixel counts as converged
+	HeatmapMode heatmap;		// measure cost of every pixel into pixel_cost
+	uint64_t* pixel_cost;		// heatmap: cost of all samples of each pixel so far, width * height
+
+	Framebuffer* framebuffer;	// output, samples are added to what is already there
+};
+
+// trace samples [estimate.count, estimate.count + samples) of pixel x, y and add them to its estimate
+void render(uint32_t x, uint32_t y, uint32_t samples, const RenderContext& ctx, PixelEstimate& estimate, uint64_t& num_rays)
+{
+	uint64_t cost_begin = ctx.heatmap != heatmap_off ? heatmap_counter(ctx.heatmap, num_rays) : 0;
+
+	for (uint32_t i = 0; i < samples; ++i)
+	{
+		Sampler sampler = make_pixel_sampler(ctx.frame_seed, x, y, estimate.count);
+		Ray ray = camera_ray(x, y, ctx.width, ctx.height, sampler);
+
+		add_sample(estimate, path_tracing(ray, *ctx.scene, ctx.bounces, sampler, num_rays));
+	}
+
+	if (ctx.heatmap != heatmap_off)
+		ctx.pixel_cost[x + y * ctx.width] += heatmap_counter(ctx.heatmap, num_rays) - cost_begin;
+}
+
+// rectangle of pixels rendered as a single unit of work
+struct Tile
+{
+	uint32_t x0, y0;	// top-left corner (inclusive)
+	uint32_t x1, y1;	// bottom-right corner (exclusive)
+};
+
+// tiles owned by a single worker, owner takes tiles from the front, other workers steal from the back
+struct TileQueue
+{
+	std::mutex mutex;
+	std::deque<Tile> tiles;
+};
+
+struct TileScheduler
+{
+	TileQueue* queues;	// one queue per worker
+	uint32_t num_queues;
+	const NumaTopology* numa;	// NULL, or node of every worker, then tiles go to workers on the node that owns their rows
+};
+
+// cut the image into tiles and deal them to workers round-robin in scanline order, so every worker starts with work spread over the whole image
+void schedule_tiles(TileScheduler& scheduler, uint32_t width, uint32_t height, uint32_t tile_size)
+{
+	uint32_t i = 0;
+
+	// with more NUMA nodes, each node's tiles are dealt round-robin between its own workers
+	const NumaTopology* numa = has_node_rows(scheduler.numa, (height + tile_size - 1) / tile_size) ? scheduler.numa : NULL;
+	std::vector<uint32_t> node_next(numa ? num_nodes(*numa) : 0);
+
+	for (uint32_t y = 0; y < height; y += tile_size)
+	{
+		for (uint32_t x = 0; x < width; x += tile_size)
+		{
+			Tile tile;
+			tile.x0 = x;
+			tile.y0 = y;
+			tile.x1 = x + tile_size < width ? x + tile_size : width;
+			tile.y1 = y + tile_size < height ? y + tile_size : height;
+
+			uint32_t queue = i % scheduler.num_queues;
+			if (numa)
+			{
+				uint32_t node = tile_row_node(*numa, y / tile_size);
+				uint32_t first, count;
+				node_workers(*numa, node, first, count);
+				queue = first + node_next[node]++ % count;
+			}
+
+			scheduler.queues[queue].tiles.push_back(tile);
+			i++;
+		}
+	}
+}
+
+// get next tile for the worker, first from its own queue, then by stealing from the others, returns false when all the work is done
+bool pop_tile(TileScheduler& scheduler, uint32_t worker, Tile& tile)
+{
+	{
+		TileQueue& own = scheduler.queues[worker];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.tiles.empty())
+		{
+			tile = own.tiles.front();
+			own.tiles.pop_front();
+			return true;
+		}
+	}
+
+	// steal from workers on the same node first, their tiles' pixels are in local memory
+	const NumaTopology* numa = scheduler.numa;
+	for (uint32_t pass = 0; pass < 2; ++pass)
+	{
+		for (uint32_t i = 1; i < scheduler.num_queues; ++i)
+		{
+			uint32_t victim_index = (worker + i) % scheduler.num_queues;
+			bool same_node = !numa || numa->worker_node[victim_index] == numa->worker_node[worker];
+			if (same_node != (pass == 0))
+				continue;
+
+			TileQueue& victim = scheduler.queues[victim_index];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if (!victim.tiles.empty())
+			{
+				tile = victim.tiles.back();
+				victim.tiles.pop_back();
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+// counts tiles left to render in each band of rows, so rows can be saved while the rest of the frame renders
+struct RowTracker
+{
+	std::mutex mutex;
+	std::condition_variable band_done;
+	uint32_t band_rows;
+	std::vector<uint32_t> tiles_left;
+};
+
+void reset_row_tracker(RowTracker& tracker, uint32_t width, uint32_t height, uint32_t tile_size)
+{
+	tracker.band_rows = tile_size;
+	tracker.tiles_left.assign((height + tile_size - 1) / tile_size, (width + tile_size - 1) / tile_size);
+}
+
+void finish_tile(RowTracker& tracker, const Tile& tile)
+{
+	std::lock_guard<std::mutex> lock(tracker.mutex);
+	if (--tracker.tiles_left[tile.y0 / tracker.band_rows] == 0)
+		tracker.band_done.notify_all();
+}
+
+// save 8-bit frame to png without an 8-bit copy of the whole frame, rows are resolved and compressed a band at a time
+// with a tracker every band is taken as soon as its tiles are done, so it can run on its own thread while workers render
+bool save_png_streamed(const Framebuffer& fb, const char* filename, RowTracker* tracker)
+{
+	const uint32_t band_rows = tracker ? tracker->band_rows : 16;
+
+	stbi_png_stream* stream = stbi_write_png_stream_begin(filename, fb.width, fb.height, 3);
+	if (!stream)
+		return false;
+
+	uint8_t* band = (uint8_t*)malloc(fb.width * 3 * band_rows);
+	bool ok = true;
+
+	for (uint32_t y = 0; y < fb.height; y += band_rows)
+	{
+		if (tracker)
+		{
+			std::unique_lock<std::mutex> lock(tracker->mutex);
+			tracker->band_done.wait(lock, [&] { return tracker->tiles_left[y / band_rows] == 0; });
+		}
+
+		// keep waiting for bands after a failed write, workers are not told to stop
+		uint32_t y1 = std::min(y + band_rows, fb.height);
+		resolve_ldr_rows(fb, y, y1, band, fb.width * 3);
+		ok = ok && stbi_write_png_stream_rows(stream, band, y1 - y, fb.width * 3);
+	}
+
+	free(band);
+	return stbi_write_png_stream_end(stream) && ok;
+}
+
+const uint32_t wavefront_samples = 16;	// samples per pixel traced together in one wave, wave has this many paths for every pixel being sampled
+
+// rays of many paths, as structure of arrays
+struct RayQueue
+{
+	std::vector<float> pos_x, pos_y, pos_z;
+	std::vector<float> dir_x, dir_y, dir_z;
+	std::vector<uint32_t> path;	// index of the path the ray belongs to
+	uint32_t count;
+};
+
+void reserve(RayQueue& queue, uint32_t capacity)
+{
+	if (queue.path.size() >= capacity)
+		return;
+
+	queue.pos_x.resize(capacity);
+	queue.pos_y.resize(capacity);
+	queue.pos_z.resize(capacity);
+	queue.dir_x.resize(capacity);
+	queue.dir_y.resize(capacity);
+	queue.dir_z.resize(capacity);
+	queue.path.resize(capacity);
+}
+
+void push(RayQueue& queue, Ray ray, uint32_t path)
+{
+	uint32_t i = queue.count++;
+	queue.pos_x[i] = ray.pos.x;
+	queue.pos_y[i] = ray.pos.y;
+	queue.pos_z[i] = ray.pos.z;
+	queue.dir_x[i] = ray.dir.x;
+	queue.dir_y[i] = ray.dir.y;
+	queue.dir_z[i] = ray.dir.z;
+	queue.path[i] = path;
+}
+
+Ray get_ray(const RayQueue& queue, uint32_t i)
+{
+	Ray ray;
+	ray.pos = { queue.pos_x[i], queue.pos_y[i], queue.pos_z[i] };
+	ray.dir = { queue.dir_x[i], queue.dir_y[i], queue.dir_z[i] };
+	return ray;
+}
+
+// state of the paths in flight
+struct Wavefront
+{
+	RayQueue rays[2];				// rays to trace at current bounce, and the ones that bounced off for the next
+	std::vector<Hit> hits;			// closest hit of every ray in current queue
+	std::vector<uint8_t> is_hit;	// 0 if the ray hit nothing
+	std::vector<Sampler> samplers;	// per path
+	std::vector<Vec3> throughput;	// per path
+	std::vector<Vec3> radiance;		// per path, light it brought to the pixel
+};
+
+// worker's scratch memory, reused for all its tiles
+struct TileState
+{
+	std::vector<uint32_t> active;	// pixels that still need samples, as framebuffer indices
+	Wavefront wavefront;
+	uint64_t num_rays = 0;			// rays traced by this worker, camera rays and bounces
+#if PATHTRACER_STATS
+	RenderStats stats = {};
+#endif
+};
+
+template <typename T>
+void grow(std::vector<T>& v, uint32_t size)
+{
+	if (v.size() < size)
+		v.resize(size);
+}
+
+// same as calling render() for every active pixel, but instead of following one path from start to end, all paths of a wave go through
+// each stage together: ray generation, closest hit, shading and bounce, accumulation
+// each stage is a tight loop over a big batch, so its code and data stay in cache
+void render_wavefront(uint32_t samples, const RenderContext& ctx, TileState& state)
+{
+	Wavefront& wf = state.wavefront;
+	PixelEstimate* estimates = ctx.framebuffer->pixels;
+	uint32_t num_active = (uint32_t)state.active.size();
+	uint32_t capacity = num_active * std::min(wavefront_samples, samples);
+
+	reserve(wf.rays[0], capacity);
+	reserve(wf.rays[1], capacity);
+	grow(wf.hits, capacity);
+	grow(wf.is_hit, capacity);
+	grow(wf.samplers, capacity);
+	grow(wf.throughput, capacity);
+	grow(wf.radiance, capacity);
+
+	for (uint32_t first_sample = 0; first_sample < samples; first_sample += wavefront_samples)
+	{
+		uint32_t wave_samples = std::min(wavefront_samples, samples - first_sample);
+
+		// generate camera rays, path index is active pixel * wave_samples + sample
+		RayQueue& camera_rays = wf.rays[0];
+		camera_rays.count = 0;
+
+		for (uint32_t a = 0; a < num_active; ++a)
+		{
+			uint32_t p = state.active[a];
+			uint32_t x, y;
+			pixel_position(*ctx.framebuffer, p, x, y);
+
+			for (uint32_t s = 0; s < wave_samples; ++s)
+			{
+				uint32_t path = a * wave_samples + s;
+				wf.samplers[path] = make_pixel_sampler(ctx.frame_seed, x, y, estimates[p].count + s);
+				wf.throughput[path] = { 1.0f, 1.0f, 1.0f };
+				push(camera_rays, camera_ray(x, y, ctx.width, ctx.height, wf.samplers[path]), path);
+			}
+		}
+
+		for (uint32_t depth = 0;; ++depth)
+		{
+			RayQueue& rays = wf.rays[depth & 1];
+			RayQueue& bounced = wf.rays[(depth + 1) & 1];
+			bounced.count = 0;
+
+			if (rays.count == 0)
+				break;
+
+			// out of bounces, all remaining paths see the background
+			if (depth == ctx.bounces)
+			{
+				PATHTRACER_STAT(thread_stats->bounce_limit += rays.count);
+				for (uint32_t i = 0; i < rays.count; ++i)
+				{
+					uint32_t path = rays.path[i];
+					wf.radiance[path] = mul(wf.throughput[path], background(get_ray(rays, i).dir));
+				}
+				break;
+			}
+
+			// closest hit
+			state.num_rays += rays.count;
+			PATHTRACER_STAT(thread_stats->rays[std::min(depth, stats_max_depth - 1)] += rays.count);
+			for (uint32_t i = 0; i < rays.count; ++i)
+			{
+				wf.is_hit[i] = intersect(get_ray(rays, i), *ctx.scene, wf.hits[i]);
+			}
+
+			// shade and bounce, finished paths leave the queue
+			for (uint32_t i = 0; i < rays.count; ++i)
+			{
+				uint32_t path = rays.path[i];
+				Ray ray = get_ray(rays, i);
+
+				if (!wf.is_hit[i])
+				{
+					PATHTRACER_STAT(thread_stats->misses++);
+					wf.radiance[path] = mul(wf.throughput[path], background(ray.dir));
+				}
+				else if (scatter(ray, wf.hits[i], depth, wf.throughput[path], wf.samplers[path]))
+				{
+					PATHTRACER_STAT(thread_stats->hits++);
+					push(bounced, ray, path);
+				}
+				else
+				{
+					PATHTRACER_STAT(thread_stats->hits++);
+					PATHTRACER_STAT(thread_stats->roulette++);
+					wf.radiance[path] = { 0.0f, 0.0f, 0.0f };
+				}
+			}
+		}
+
+		// accumulate in sample order, so the sum is exactly the same as in render()
+		for (uint32_t a = 0; a < num_active; ++a)
+		{
+			for (uint32_t s = 0; s < wave_samples; ++s)
+			{
+				add_sample(estimates[state.active[a]], wf.radiance[a * wave_samples + s]);
+			}
+		}
+	}
+}
+
+// add samples to every active pixel of the tile
+void render_active(uint32_t samples, const RenderContext& ctx, TileState& state)
+{
+	// wavefront traces many pixels at once, heatmap needs them one by one
+	if (ctx.wavefront && ctx.heatmap == heatmap_off)
+	{
+		render_wavefront(samples, ctx, state);
+		return;
+	}
+
+	for (uint32_t p : state.active)
+	{
+		uint32_t x, y;
+		pixel_position(*ctx.framebuffer, p, x, y);
+		render(x, y, samples, ctx, ctx.framebuffer->pixels[p], state.num_rays);
+	}
+}
+
+void render_tile(Tile tile, const RenderContext& ctx, TileState& state)
+{
+	PixelEstimate* estimates = ctx.framebuffer->pixels;
+	uint32_t num_pixels = (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+
+	PATHTRACER_STAT(thread_stats = &state.stats);
+
+	state.active.clear();
+	for (uint32_t y = tile.y0; y < tile.y1; ++y)
+	{
+		for (uint32_t x = tile.x0; x < tile.x1; ++x)
+		{
+			state.active.push_back(pixel_index(*ctx.framebuffer, x, y));
+		}
+	}
+
+	if (!ctx.adaptive)
+	{
+		render_active(ctx.samples, ctx, state);
+		return;
+	}
+
+	// tile has a budget of samples * pixels, converged pixels stop early and leave their share to the noisy ones
+	// pixels that converged in earlier passes don't take part at all
+	uint64_t budget = (uint64_t)ctx.samples * num_pixels;
+	uint32_t min_count = ctx.max_samples;
+	uint32_t num_active = 0;
+	for (uint32_t p : state.active)
+	{
+		if (!converged(estimates[p], ctx.min_samples, ctx.max_samples, ctx.adaptive_threshold))
+		{
+			state.active[num_active++] = p;
+			min_count = std::min(min_count, estimates[p].count);
+		}
+	}
+	state.active.resize(num_active);
+
+	// pixels that weren't sampled yet get min_samples first, then adaptive_step at a time
+	uint32_t step = min_count < ctx.min_samples ? ctx.min_samples - min_count : ctx.adaptive_step;
+	step = std::min(step, ctx.samples);
+	for (uint32_t p : state.active)
+	{
+		step = std::min(step, ctx.max_samples - estimates[p].count);
+	}
+
+	while (!state.active.empty() && step > 0)
+	{
+		render_active(step, ctx, state);
+		budget -= std::min(budget, (uint64_t)step * state.active.size());
+
+		// keep only pixels that are still noisy and can take more samples
+		num_active = 0;
+		for (uint32_t p : state.active)
+		{
+			if (!converged(estimates[p], ctx.min_samples, ctx.max_samples, ctx.adaptive_threshold))
+				state.active[num_active++] = p;
+		}
+		state.active.resize(num_active);
+
+		if (num_active == 0)
+			break;
+
+		step = std::min(ctx.adaptive_step, (uint32_t)(budget / num_active));
+		for (uint32_t p : state.active)
+		{
+			step = std::min(step, ctx.max_samples - estimates[p].count);
+		}
+	}
+}
+
+// three spheres on a floor, the scene of the whole series
+void add_reference_scene(Scene& scene)
+{
+	scene.spheres.push_back({ {-2.0f, 0.0f, 0.0f}, 1.0f, {0.8f, 0.3f, 0.2f}, 0.04f });
+	scene.spheres.push_back({ {0.0f, 0.0f, 0.0f}, 1.0f, {0.3f, 0.8f, 0.2f}, 0.3f });
+	scene.spheres.push_back({ {2.0f, 0.0f, 0.0f}, 1.0f, {0.2f, 0.3f, 0.8f}, 0.9f });
+	scene.planes.push_back({ {0.0f, 1.0f, 0.0f}, -1.0f, {0.8f, 0.8f, 0.8f}, 0.9f });
+}
+
+// scatter count small spheres with random colors and roughness on the floor, for testing bigger scenes
+void add_sphere_field(Scene& scene, uint32_t count, uint64_t seed)
+{
+	Sampler sampler = make_sampler(seed, 0);
+
+	// make spheres smaller as their number grows, so they cover roughly the same part of the floor
+	float radius = 0.3f / sqrtf(fmaxf(count / 1000.0f, 1.0f));
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		Sphere sphere;
+		sphere.radius = radius * (0.5f + randf(sampler));
+		sphere.pos = { 16.0f * randf(sampler) - 8.0f, 1.0f - sphere.radius, 20.0f * randf(sampler) - 1.0f };
+		sphere.color = { 0.2f + 0.7f * randf(sampler), 0.2f + 0.7f * randf(sampler), 0.2f + 0.7f * randf(sampler) };
+		sphere.roughness = 0.9f * randf(sampler);
+		scene.spheres.push_back(sphere);
+	}
+}
+
+#ifndef PATHTRACER_NO_MAIN
+int main(int argc, const char* argv[])
+{
+	// settings
+	const uint32_t width = 1024;
+	const uint32_t height = 768;
+	const uint32_t bounces = 10;
+	const uint32_t samples = 1000;
+	const uint32_t tile_size = 32;	// width and height of a tile in pixels, smaller tiles balance better, bigger tiles have less scheduling overhead
+	const bool deterministic = true;	// same image, bit for bit, on every run and any number of threads; false gives different noise every run
+	const uint64_t frame_seed = deterministic ? 1 : (uint64_t)time(NULL);
+	const uint32_t sphere_field = 0;	// number of extra small spheres scattered on the floor
+	const bool wavefront = false;		// trace paths in big batches stage by stage, instead of one by one, gives the same image
+	const bool adaptive = true;			// spend samples where the image is noisy, 'samples' becomes the average
+	const bool progressive = true;		// render in passes of pass_samples until one of the stop conditions below, or 'samples' per pixel
+	const uint32_t pass_samples = 16;
+	const double time_budget = 0.0;		// progressive: stop when next pass would end after this many seconds, 0 - no limit
+	const float noise_target = 0.01f;	// progressive: stop when average relative error of pixels gets below this, 0 - no target
+	const bool stream_png = false;		// save render.png a few rows at a time, needs much less memory for huge frames but compresses on one thread
+	const bool encode_while_rendering = true;	// save render.png from a separate thread during the last pass, as rows get done; progressive: last pass is predicted, on a miss render.png is saved again at the end
+	const HeatmapMode heatmap = heatmap_off;	// save how expensive each pixel was to heatmap.png, see HeatmapMode
+	const FramebufferLayout framebuffer_layout = layout_tiles;	// tiled layouts keep workers from writing to the same cache lines at tile edges
+	const bool numa_aware = true;		// with more NUMA nodes: pin workers to nodes, each node renders the rows whose memory it touched first
+	const bool replicate_scene = false;	// numa: every node gets its own copy of the scene, so BVH reads stay in local memory
+	const bool trace_timeline = false;	// save what every thread did and when to trace.json, open it in chrome://tracing or ui.perfetto.dev
+
+	// useful variables
+	const uint32_t stride = 3;
+	const uint32_t image_size = width * height * stride;
+	const uint32_t num_threads = std::thread::hardware_concurrency();
+
+	// timeline, every thread records into its own buffer, which costs a couple of clock reads per tile
+	Trace timeline;
+	Trace* trace = NULL;
+	if (trace_timeline)
+	{
+		create_trace(timeline, num_threads);
+		trace = &timeline;
+	}
+
+	const uint32_t trace_main = 0;
+	const uint32_t trace_encoder = num_threads + 1;
+
+	// NUMA, with a single node (turned off, or not detected) nothing below changes
+	NumaTopology numa = detect_numa(num_threads, numa_aware);
+	assign_tile_rows(numa, (height + tile_size - 1) / tile_size);
+
+	if (num_nodes(numa) > 1)
+		printf("NUMA: %u nodes, workers pinned to their nodes\n", num_nodes(numa));
+
+	pin_workers(numa);
+
+	Framebuffer framebuffer = create_framebuffer(width, height, framebuffer_layout, tile_size, &numa);
+
+	// scene
+	uint64_t scene_begin = trace_time(trace);
+	Scene scene;
+	add_reference_scene(scene);
+	add_sphere_field(scene, sphere_field, frame_seed);
+	double build_time = build_bvh(scene, num_threads);
+	trace_event(trace, trace_main, "scene build", scene_begin);
+	print_bvh_stats(scene.bvh, build_time);
+
+	// copy of the scene for every node, made by the node's first worker so that its memory is local to the node
+	std::vector<Scene> node_scenes(replicate_scene && num_nodes(numa) > 1 ? num_nodes(numa) : 0);
+	if (!node_scenes.empty())
+	{
+		parallel_run(num_threads, [&](uint32_t thread_id) {
+			uint32_t node = numa.worker_node[thread_id];
+			uint32_t first, count;
+			node_workers(numa, node, first, count);
+			if (thread_id == first)
+				node_scenes[node] = scene;
+		});
+	}
+
+	RenderContext ctx = {};
+	ctx.width = width;
+	ctx.height = height;
+	ctx.bounces = bounces;
+	ctx.samples = samples;
+	ctx.frame_seed = frame_seed;
+	ctx.scene = &scene;
+	ctx.wavefront = wavefront;
+	ctx.adaptive = adaptive;
+	ctx.min_samples = 32;
+	ctx.max_samples = 4 * samples;
+	ctx.adaptive_step = 16;
+	ctx.adaptive_threshold = 0.005f;
+	ctx.framebuffer = &framebuffer;
+
+	std::vector<uint64_t> pixel_cost;
+	if (heatmap != heatmap_off)
+	{
+		pixel_cost.resize(width * height);
+		ctx.heatmap = heatmap;
+		ctx.pixel_cost = pixel_cost.data();
+
+		if (heatmap == heatmap_tests && !PATHTRACER_STATS)
+			printf("Heatmap of intersection tests needs PATHTRACER_STATS=1, heatmap.png will be black\n");
+	}
+
+	TileScheduler scheduler = {};
+	scheduler.queues = new TileQueue[num_threads];
+	scheduler.num_queues = num_threads;
+	scheduler.numa = &numa;
+
+	std::vector<TileState> states(num_threads);
+	std::vector<uint64_t> worker_done(num_threads);	// when each worker ran out of tiles, for the timeline
+
+	RowTracker tracker;
+	bool encoded = false;
+	int32_t res = 0;
+
+	auto start = std::chrono::steady_clock::now();
+	double last_pass_time = 0.0;
+	float last_noise = 0.0f;
+	bool predicted_last = false;	// next pass is expected to meet noise target or time budget
+	uint32_t total_samples = 0;
+
+	// without progressive rendering the whole frame is a single pass
+	const uint32_t samples_per_pass = progressive ? pass_samples : samples;
+
+	while (total_samples < samples)
+	{
+		auto pass_start = std::chrono::steady_clock::now();
+		uint64_t pass_begin = trace_time(trace);
+
+		ctx.samples = std::min(samples_per_pass, samples - total_samples);
+		total_samples += ctx.samples;
+
+		// workers of each node read their node's copy of the scene
+		std::vector<RenderContext> node_ctx(num_nodes(numa), ctx);
+		for (uint32_t node = 0; node < node_scenes.size(); ++node)
+		{
+			node_ctx[node].scene = &node_scenes[node];
+		}
+
+		// split work into tiles
+		schedule_tiles(scheduler, width, height, tile_size);
+		reset_row_tracker(tracker, width, height, tile_size);
+
+		if (!progressive)
+			printf("Scheduled %i jobs:\n", num_threads);
+
+		// rows of the last pass are final as soon as they are rendered, encoder saves them while workers continue
+		std::thread encoder;
+		if (encode_while_rendering && (total_samples == samples || predicted_last))
+		{
+			encoded = true;
+			encoder = std::thread([&] {
+				uint64_t encode_begin = trace_time(trace);
+				res = save_png_streamed(framebuffer, "render.png", &tracker);
+				trace_event(trace, trace_encoder, "encode", encode_begin);
+			});
+		}
+
+		// render tiles until there is nothing left to take or steal
+		parallel_run(num_threads, [&](uint32_t thread_id) {
+			Tile tile;
+			while (pop_tile(scheduler, thread_id, tile))
+			{
+				uint64_t tile_begin = trace_time(trace);
+				render_tile(tile, node_ctx[numa.worker_node[thread_id]], states[thread_id]);
+				finish_tile(tracker, tile);
+				trace_event(trace, 1 + thread_id, "tile", tile_begin, tile.x0, tile.y0);
+			}
+
+			worker_done[thread_id] = trace_time(trace);
+
+			if (!progressive)
+				printf("- job %i ready.\n", thread_id);
+		});
+
+		// time from the first worker running out of tiles to the last one finishing
+		trace_event(trace, trace_main, "join", *std::min_element(worker_done.begin(), worker_done.end()));
+
+		if (encoder.joinable())
+			encoder.join();
+
+		trace_event(trace, trace_main, "pass", pass_begin);
+
+		if (!progressive)
+			break;
+
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		std::chrono::duration<double> pass_time = std::chrono::steady_clock::now() - pass_start;
+		last_pass_time = pass_time.count();
+
+		float noise = frame_noise(framebuffer);
+		printf("Pass: %u spp, noise %.4f, %.2f s\n", total_samples, noise, elapsed.count());
+
+		if (noise_target > 0.0f && noise < noise_target)
+		{
+			printf("Noise target reached.\n");
+			break;
+		}
+
+		if (time_budget > 0.0 && elapsed.count() + last_pass_time > time_budget)
+		{
+			printf("Time budget reached.\n");
+			break;
+		}
+
+		// prediction missed, render.png saved during this pass is overwritten after the render
+		if (encoded && total_samples < samples)
+		{
+			printf("Pass was not the last one, render.png will be saved again.\n");
+			encoded = false;
+		}
+
+		// guess if the next pass is the last one, so its rows can be encoded while it renders
+		// noise is expected to fall by the same ratio as during this pass, and the next pass to take as long as this one
+		float next_noise = last_noise > 0.0f ? noise * noise / last_noise : noise;
+		predicted_last = (noise_target > 0.0f && next_noise < noise_target) || (time_budget > 0.0 && elapsed.count() + 2.0 * last_pass_time > time_budget);
+		last_noise = noise;
+	}
+
+	std::chrono::duration<double> render_time = std::chrono::steady_clock::now() - start;
+	uint64_t num_rays = 0;
+	for (const TileState& state : states)
+	{
+		num_rays += state.num_rays;
+	}
+
+	printf("Render done in %.2f s, %.2f Mrays/s.\n", render_time.count(), num_rays / render_time.count() / 1e6);
+
+#if PATHTRACER_STATS
+	RenderStats stats = {};
+	for (const TileState& state : states)
+	{
+		merge_stats(stats, state.stats);
+	}
+	print_render_stats(stats);
+#endif
+
+	delete[] scheduler.queues;
+
+	uint64_t encode_begin = trace_time(trace);
+
+	if (encoded)
+	{
+		// already saved during the last pass
+	}
+	else if (stream_png)
+	{
+		// translate to bytes and save to 'render.png' band by band
+		res = save_png_streamed(framebuffer, "render.png", NULL);
+	}
+	else
+	{
+		// allocate image memory and translate from float colors to bytes
+		void* image = malloc(image_size);
+		resolve_ldr(framebuffer, (uint8_t*)image, stride * width);
+
+		// save image to 'render.png'
+		res = stbi_write_png("render.png", width, height, 3, image, stride * width);
+
+		free(image);
+	}
+
+	if (!encoded)
+		trace_event(trace, trace_main, "encode", encode_begin);
+
+	if (res)
+		printf("\nSaved to render.png\n");
+	else
+		printf("\nCannot save to render.png\n");
+
+	// save linear float colors to 'render.hdr', keeps everything brighter than white
+	uint64_t hdr_begin = trace_time(trace);
+	float* hdr_image = (float*)malloc(width * height * 3 * sizeof(float));
+	resolve_hdr(framebuffer, hdr_image);
+
+	if (stbi_write_hdr("render.hdr", width, height, 3, hdr_image))
+		printf("Saved to render.hdr\n");
+	else
+		printf("Cannot save to render.hdr\n");
+
+	trace_event(trace, trace_main, "save hdr", hdr_begin);
+
+	free(hdr_image);
+
+	// save map of where adaptive sampling spent the samples, white is the most samples any pixel got
+	if (adaptive)
+	{
+		uint32_t max_count = 1;
+		for (uint32_t i = 0; i < width * height; ++i)
+		{
+			max_count = std::max(max_count, framebuffer.pixels[pixel_index(framebuffer, i % width, i / width)].count);
+		}
+
+		uint8_t* sample_map = (uint8_t*)malloc(width * height);
+		for (uint32_t i = 0; i < width * height; ++i)
+		{
+			sample_map[i] = (uint8_t)(255.0f * framebuffer.pixels[pixel_index(framebuffer, i % width, i / width)].count / max_count);
+		}
+
+		if (stbi_write_png("samples.png", width, height, 1, sample_map, width))
+			printf("Saved sample count map to samples.png (white = %u samples)\n", max_count);
+		else
+			printf("Cannot save to samples.png\n");
+
+		free(sample_map);
+	}
+
+	// save map of how expensive pixels were, white is the 99th percentile of cost per sample
+	if (heatmap != heatmap_off)
+	{
+		const char* units[] = { "", "cycles", "rays", "tests" };
+
+		float white = 0.0f;
+		if (save_heatmap(framebuffer, pixel_cost.data(), "heatmap.png", white))
+			printf("Saved cost heatmap to heatmap.png (white = %.1f %s per sample)\n", white, units[heatmap]);
+		else
+			printf("Cannot save to heatmap.png\n");
+	}
+
+	if (trace)
+	{
+		if (save_trace(timeline, "trace.json"))
+			printf("Saved timeline to trace.json\n");
+		else
+			printf("Cannot save to trace.json\n");
+	}
+
+	// release image memory
+	destroy_framebuffer(framebuffer);
 
 	return res;
-}
\ No newline at end of file
+}
+#endif // PATHTRACER_NO_MAIN
\ No newline at end of file